@@ -0,0 +1,52 @@
+#!/bin/sh
+# Effect of connection tuning done by ll_init() on nul1fs and nullfs.
+#
+# Each daemon is mounted twice: with libfuse's old defaults forced by
+# mount options (128KiB writes, 12 background requests, sync reads,
+# serialized dirops) and with ll_init() defaults. For each mount it
+# prints number of WRITE requests the kernel sent for SIZE_MB of
+# sequential writes (counted from a debug run) and write throughput
+# (from a non-debug run).
+#
+# usage: bench/conn_tuning.sh [size_mb [mountpoint]]
+
+SIZE_MB=${1:-1024}
+MNT=${2:-/tmp/nullfs_bench.$$}
+OLD="max_write=131072,max_background=12,congestion_threshold=9"
+OLD="$OLD,sync_read,no_parallel_dirops"
+
+mkdir -p "$MNT" || exit 1
+
+umnt() {
+    fusermount3 -u "$MNT" 2>/dev/null || fusermount -u "$MNT"
+}
+
+# run FS OPTS: prints "FS OPTS writes=N MB/s=M"
+run() {
+    fs=$1 opts=$2
+    log=/tmp/nullfs_bench.$$.log
+
+    ./$fs -d ${opts:+-o $opts} "$MNT" 2>"$log" &
+    sleep 1
+    dd if=/dev/zero of="$MNT/f" bs=1M count="$SIZE_MB" \
+        conv=fsync 2>/dev/null
+    umnt
+    wait
+    writes=$(grep -c 'opcode: WRITE' "$log")
+    rm -f "$log"
+
+    ./$fs ${opts:+-o $opts} "$MNT" || exit 1
+    rate=$(dd if=/dev/zero of="$MNT/f" bs=1M count="$SIZE_MB" \
+        conv=fsync 2>&1 | sed -n 's/.*, \([0-9.,]* [kMG]*B\/s\)$/\1/p')
+    umnt
+
+    echo "$fs ${opts:-defaults} writes=$writes rate=$rate"
+}
+
+for fs in nul1fs nullfs; do
+    run $fs "$OLD"
+    run $fs ""
+done
+
+rmdir "$MNT" 2>/dev/null
+exit 0
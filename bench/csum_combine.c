@@ -0,0 +1,89 @@
+/*
+    Checksum of out-of-order writes against a direct CRC.
+
+    Writes "hello" and size_mb MiB plus 4KiB of zeros to a file's
+    checksum state last chunk first, the way writeback can send them,
+    so every chunk is prepended to one growing range, and compares the
+    merged CRC with the CRC-32C of the same bytes in order. The
+    default size is past 512MiB, where the shift of a range needs
+    x^(2^n) for n over 31. Reports both CRCs and GB/s of each.
+
+    usage: csum_combine [size_mb [chunk_kb]]
+*/
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 312
+#include <fuse3/fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../nullfs_csum.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t size = ((argc > 1 ? (uint64_t) atol(argv[1]) : 512) << 20)
+        + 4096;
+    size_t chunk = (argc > 2 ? (size_t) atol(argv[2]) : 1024) << 10;
+    static const char head[] = "hello";
+    struct fuse_conn_info conn;
+    struct csum_file f;
+    unsigned char *zero;
+    uint32_t direct, crc;
+    uint64_t off, end;
+    double t0, t_direct, t_merged;
+    char digest[64];
+    int ok;
+
+    zero = calloc(1, chunk);
+    if (zero == NULL || chunk == 0) {
+        fprintf(stderr, "csum_combine: bad chunk size\n");
+        return 1;
+    }
+    memset(&conn, 0, sizeof(conn));
+    memset(&f, 0, sizeof(f));
+    nullfs_csum = 1;
+    nullfs_csum_init(&conn);
+    size += sizeof(head) - 1;
+
+    t0 = now();
+    crc = csum_fn(~0U, (const unsigned char *) head, sizeof(head) - 1);
+    for (off = sizeof(head) - 1; off < size; off += chunk)
+        crc = csum_fn(crc, zero,
+            size - off < chunk ? size - off : chunk);
+    direct = ~crc;
+    t_direct = now() - t0;
+
+    t0 = now();
+    for (end = size; end > sizeof(head) - 1; end = off) {
+        off = end - (sizeof(head) - 1) < chunk ? sizeof(head) - 1
+            : end - chunk;
+        csum_add(&f, off, end, nullfs_crc32c(zero, end - off));
+    }
+    csum_add(&f, 0, sizeof(head) - 1,
+        nullfs_crc32c(head, sizeof(head) - 1));
+    t_merged = now() - t0;
+
+    if (f.n == 1 && ! f.invalid && f.r[0].start == 0)
+        snprintf(digest, sizeof(digest), "%08x %llu", f.r[0].crc,
+            (unsigned long long) f.r[0].end);
+    else
+        snprintf(digest, sizeof(digest), "%u ranges", f.n);
+    printf("size:   %llu\n", (unsigned long long) size);
+    printf("direct: %08x %llu (%.2f GB/s)\n", direct,
+        (unsigned long long) size, size / t_direct / 1e9);
+    printf("merged: %s (%.2f GB/s)\n", digest, size / t_merged / 1e9);
+
+    ok = f.n == 1 && ! f.invalid && f.r[0].crc == direct;
+    if (! ok) printf("MISMATCH\n");
+    free(f.r);
+    free(zero);
+    return ok ? 0 : 1;
+}
+
+/* vi:set sw=4 et tw=72: */
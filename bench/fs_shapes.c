@@ -0,0 +1,282 @@
+/*
+    Standard workload shapes run against a mounted filesystem.
+
+    Runs one shape in dir and prints one line per measured syscall
+    kind: "shape rate unit p50_us p99_us", rate being throughput of
+    the whole run and p50/p99 the latency of single calls. A shape
+    the filesystem can't run (e.g. mkdir on nul1fs) prints "-"s.
+
+      stream BS    write size_mb to one file in BS byte writes
+      parallel T   T threads, each writing size_mb/T to its own
+                   file in 1MiB writes
+      small N      N files created, written 4KiB and closed; one
+                   latency sample per file
+      deep D       D nested mkdirs, then 10000 stats of the deepest
+      bigdir N     N empty files created in one directory, then
+                   listed and each one stat'ed
+
+    usage: fs_shapes dir shape arg [size_mb]
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* latency samples, ns */
+struct lat {
+    uint64_t *ns;
+    size_t n, cap;
+};
+
+static const char *dir;
+static size_t size;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void lat_add(struct lat *l, uint64_t ns) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 4096;
+        l->ns = realloc(l->ns, l->cap * sizeof(*l->ns));
+        if (l->ns == NULL) {
+            perror("fs_shapes");
+            exit(1);
+        };
+    };
+    l->ns[l->n++] = ns;
+}
+
+static int cmp_ns(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* prints rate of n units in ns and percentiles of l, or "-"s when
+   the shape failed */
+static void report(const char *shape, double n, const char *unit,
+uint64_t ns, struct lat *l, int failed) {
+    if (failed || l->n == 0) {
+        printf("%s - - - -\n", shape);
+    } else {
+        qsort(l->ns, l->n, sizeof(*l->ns), cmp_ns);
+        printf("%s %.1f %s %.1f %.1f\n", shape, n * 1e9 / ns, unit,
+            l->ns[l->n / 2] / 1e3, l->ns[l->n * 99 / 100] / 1e3);
+    };
+    fflush(stdout);
+    l->n = 0;
+}
+
+static int stream(const char *name, size_t bs, size_t total,
+struct lat *l) {
+    char *buf = malloc(bs), path[4096];
+    size_t done;
+    int fd, err = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0 || buf == NULL) {
+        free(buf);
+        return errno;
+    };
+    memset(buf, 0xa5, bs);
+    for (done = 0; done < total; done += bs) {
+        uint64_t t = now_ns();
+        if (write(fd, buf, bs) != (ssize_t) bs) {
+            err = errno ? errno : EIO;
+            break;
+        };
+        lat_add(l, now_ns() - t);
+    };
+    if (close(fd) && ! err) err = errno;
+    unlink(path);
+    free(buf);
+    return err;
+}
+
+struct writer {
+    pthread_t t;
+    int i, err;
+    size_t total;
+    struct lat l;
+};
+
+static void *writer_thread(void *arg) {
+    struct writer *w = arg;
+    char name[64];
+
+    snprintf(name, sizeof(name), "parallel.%d", w->i);
+    w->err = stream(name, 1 << 20, w->total, &w->l);
+    return NULL;
+}
+
+static int parallel(int n, struct lat *l) {
+    struct writer *w = calloc(n, sizeof(*w));
+    int i, err = 0;
+
+    if (w == NULL) return ENOMEM;
+    for (i = 0; i < n; i++) {
+        w[i].i = i;
+        w[i].total = size / n;
+        pthread_create(&w[i].t, NULL, writer_thread, &w[i]);
+    };
+    for (i = 0; i < n; i++) {
+        pthread_join(w[i].t, NULL);
+        if (w[i].err) err = w[i].err;
+        for (size_t k = 0; k < w[i].l.n; k++) lat_add(l, w[i].l.ns[k]);
+        free(w[i].l.ns);
+    };
+    free(w);
+    return err;
+}
+
+static int small(long n, struct lat *l) {
+    char buf[4096], path[4096];
+    long i;
+
+    memset(buf, 0x5a, sizeof(buf));
+    for (i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        int fd;
+        snprintf(path, sizeof(path), "%s/small.%ld", dir, i);
+        fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+        if (fd < 0) return errno;
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            close(fd);
+            return errno ? errno : EIO;
+        };
+        if (close(fd)) return errno;
+        lat_add(l, now_ns() - t);
+    };
+    return 0;
+}
+
+static void deep(long d) {
+    struct lat l = {0};
+    char *path = malloc(strlen(dir) + 2 * d + 8);
+    struct stat st;
+    uint64_t t0;
+    int err = 0;
+    long i;
+
+    sprintf(path, "%s/deep", dir);
+    t0 = now_ns();
+    for (i = 0; i < d; i++) {
+        uint64_t t = now_ns();
+        if (i > 0) strcat(path, "/d");
+        if (mkdir(path, 0755) && errno != EEXIST) {
+            err = errno;
+            break;
+        };
+        lat_add(&l, now_ns() - t);
+    };
+    report("deep-mkdir", d, "ops/s", now_ns() - t0, &l, err);
+    t0 = now_ns();
+    for (i = 0; ! err && i < 10000; i++) {
+        uint64_t t = now_ns();
+        if (stat(path, &st)) err = errno;
+        lat_add(&l, now_ns() - t);
+    };
+    report("deep-stat", 10000, "ops/s", now_ns() - t0, &l, err);
+    free(path);
+    free(l.ns);
+}
+
+static void bigdir(long n) {
+    struct lat l = {0};
+    char base[4096], path[sizeof(base) + 300];
+    struct dirent *de;
+    struct stat st;
+    uint64_t t0;
+    long i, listed = 0;
+    int err = 0;
+    DIR *d;
+
+    /* nul1fs has no directories but "/" */
+    snprintf(base, sizeof(base), "%s/bigdir", dir);
+    if (mkdir(base, 0755) && errno != EEXIST)
+        snprintf(base, sizeof(base), "%s", dir);
+
+    t0 = now_ns();
+    for (i = 0; i < n; i++) {
+        uint64_t t = now_ns();
+        int fd;
+        snprintf(path, sizeof(path), "%s/e%ld", base, i);
+        fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd < 0) {
+            err = errno;
+            break;
+        };
+        close(fd);
+        lat_add(&l, now_ns() - t);
+    };
+    report("bigdir-create", n, "ops/s", now_ns() - t0, &l, err);
+
+    t0 = now_ns();
+    d = opendir(base);
+    while (d != NULL && (de = readdir(d)) != NULL) {
+        uint64_t t = now_ns();
+        snprintf(path, sizeof(path), "%s/%s", base, de->d_name);
+        if (stat(path, &st) == 0) listed++;
+        lat_add(&l, now_ns() - t);
+    };
+    if (d == NULL) err = errno;
+    else closedir(d);
+    report("bigdir-stat", listed, "ops/s", now_ns() - t0, &l, err);
+    free(l.ns);
+}
+
+int main(int argc, char *argv[]) {
+    struct lat l = {0};
+    char label[64];
+    const char *shape;
+    long arg;
+    uint64_t t0;
+    int err;
+
+    if (argc < 4) {
+        fprintf(stderr, "usage: fs_shapes dir shape arg [size_mb]\n");
+        return 2;
+    };
+    dir = argv[1];
+    shape = argv[2];
+    arg = atol(argv[3]);
+    size = (argc > 4 ? (size_t) atol(argv[4]) : 256) << 20;
+    if (arg < 1) arg = 1;
+    snprintf(label, sizeof(label), "%s:%ld", shape, arg);
+
+    t0 = now_ns();
+    if (! strcmp(shape, "stream")) {
+        err = stream("stream", arg, size, &l);
+        report(label, size / 1048576.0, "MB/s", now_ns() - t0, &l, err);
+    } else if (! strcmp(shape, "parallel")) {
+        err = parallel(arg, &l);
+        report(label, size / 1048576.0, "MB/s", now_ns() - t0, &l, err);
+    } else if (! strcmp(shape, "small")) {
+        err = small(arg, &l);
+        report(label, arg, "files/s", now_ns() - t0, &l, err);
+    } else if (! strcmp(shape, "deep")) {
+        deep(arg);
+    } else if (! strcmp(shape, "bigdir")) {
+        bigdir(arg);
+    } else {
+        fprintf(stderr, "fs_shapes: unknown shape %s\n", shape);
+        return 2;
+    };
+    free(l.ns);
+
+    return 0;
+}
+
+/* vi:set sw=4 et tw=72: */
@@ -0,0 +1,90 @@
+/*
+    Lookup scalability benchmark for nullfs path index.
+
+    Populates nullfs.c++ tree with files and measures how many
+    lookups (as done by nullfs_lookup() and dropped by forget) per
+    second N threads manage together.
+
+    usage: lookup_mt [n_files [seconds]]
+*/
+
+#define NULLFS_NO_MAIN
+#include "../nullfs.c++"
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+using std::string;
+
+static std::vector<node *> dirs;
+static std::vector<string> names;
+static volatile int stop;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+};
+
+static void *lookup_thread(void *arg) {
+    unsigned long *n_ops = (unsigned long *) arg;
+    unsigned long n = 0;
+    size_t i = (size_t) n_ops * 2654435761u;
+    while (! stop) {
+        for (int k = 0; k < 1024; k++) {
+            i = i * 6364136223846793005ULL + 1442695040888963407ULL;
+            size_t f = (i >> 33) % names.size();
+            node *n = lookup_node(dirs[f % dirs.size()], names[f].c_str());
+            if (n) put_node(n);
+        };
+        n += 1024;
+    };
+    *n_ops = n;
+    return NULL;
+};
+
+int main(int argc, char *argv[]) {
+    int n_files = argc > 1 ? atoi(argv[1]) : 1000000;
+    double secs = argc > 2 ? atof(argv[2]) : 2.0;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    char buf[64];
+    node *n;
+
+    for (int i = 0; i < 1000; i++) {
+        snprintf(buf, sizeof(buf), "d%03d", i);
+        add_node(root, buf, NULLFS_DIR, &n);
+        dirs.push_back(n);
+    };
+    for (int i = 0; i < n_files; i++) {
+        snprintf(buf, sizeof(buf), "f%d", i);
+        names.push_back(string(buf));
+        if (add_node(dirs[i % 1000], buf, NULLFS_FILE, &n) >= 0)
+            put_node(n);
+    };
+    printf("%d files in 1000 dirs, %d shards\n", n_files, N_SHARDS);
+    printf("threads  lookups/s\n");
+
+    for (long n = 1; n <= n_cpus; n *= 2) {
+        std::vector<pthread_t> t(n);
+        std::vector<unsigned long> ops(n);
+        unsigned long total = 0;
+        stop = 0;
+        double t0 = now();
+        for (long i = 0; i < n; i++)
+            pthread_create(&t[i], NULL, lookup_thread, &ops[i]);
+        usleep((useconds_t) (secs * 1e6));
+        stop = 1;
+        for (long i = 0; i < n; i++) {
+            pthread_join(t[i], NULL);
+            total += ops[i];
+        };
+        printf("%7ld  %9.0f\n", n, total / (now() - t0));
+    };
+
+    return 0;
+};
+
+/* vi:set sw=4 et tw=72: */
@@ -0,0 +1,61 @@
+#!/bin/sh
+# End-to-end comparison of nul1fs, nullfs and nulnfs through a mount.
+#
+# Mounts each daemon in turn and runs bench/fs_shapes shapes on it:
+# streaming writes at 4KiB, 64KiB and 1MiB, 4 parallel writers, many
+# small files, a deep tree and a large directory. Prints one table
+# with throughput, p50/p99 latency of single syscalls and daemon's
+# resident memory after each shape, so daemon plus kernel overhead
+# can be compared side by side. Shapes a daemon can't run show "-".
+#
+# usage: bench/mount_suite.sh [size_mb [n_files [mountpoint]]]
+
+SIZE_MB=${1:-256}
+N=${2:-10000}
+MNT=${3:-/tmp/nullfs_suite.$$}
+SHAPES="stream:4096 stream:65536 stream:1048576 parallel:4 small:$N"
+SHAPES="$SHAPES deep:64 bigdir:$N"
+
+[ -x bench/fs_shapes ] || make bench/fs_shapes || exit 1
+mkdir -p "$MNT" || exit 1
+
+umnt() {
+    fusermount3 -u "$MNT" 2>/dev/null || fusermount -u "$MNT"
+}
+
+mounted() {
+    grep -q " $MNT fuse" /proc/mounts
+}
+
+printf "%-7s %-16s %12s %-7s %9s %9s %9s\n" \
+    fs shape rate unit p50_us p99_us rss_kb
+for fs in nul1fs nullfs nulnfs; do
+    ./$fs -f "$MNT" &
+    pid=$!
+    i=0
+    while ! mounted && [ $i -lt 50 ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+    if ! mounted; then
+        echo "$fs: mount failed"
+        kill $pid 2>/dev/null
+        continue
+    fi
+
+    for s in $SHAPES; do
+        bench/fs_shapes "$MNT" ${s%%:*} ${s#*:} "$SIZE_MB" |
+        while read shape rate unit p50 p99; do
+            rss=$(sed -n 's/^VmRSS:[^0-9]*\([0-9]*\).*/\1/p' \
+                /proc/$pid/status 2>/dev/null)
+            printf "%-7s %-16s %12s %-7s %9s %9s %9s\n" \
+                $fs $shape $rate $unit $p50 $p99 "${rss:--}"
+        done
+    done
+
+    umnt
+    wait $pid
+done
+
+rmdir "$MNT" 2>/dev/null
+exit 0
@@ -0,0 +1,80 @@
+/*
+    Dirent memory benchmark for nulnfs.
+
+    Inserts n_entries dirents with names of at least name_len bytes
+    into nulnfs root directory (without going through fuse) and
+    reports dirent record size, name arena size, resident memory
+    per entry, insert rate and lookup rate.
+
+    usage: nulnfs_mem [n_entries [name_len]]
+*/
+
+#define NULLFS_NO_MAIN
+#include "../nulnfs.c"
+
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long rss_bytes(void) {
+    long pages = 0, rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2) rss = 0;
+    fclose(f);
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+static void entry_name(char *buf, size_t sz, long i, int name_len) {
+    snprintf(buf, sz, "%0*ld", name_len, i);
+}
+
+int main(int argc, char *argv[]) {
+    long n = argc > 1 ? atol(argv[1]) : 1000000;
+    int name_len = argc > 2 ? atoi(argv[2]) : 8;
+    struct nulnfs_inode *root;
+    long rss0, i, found = 0;
+    char buf[300];
+    double t0, t1, t2;
+
+    if (name_len < 1 || name_len > 255) name_len = 8;
+    conf.max_inodes = POOL_CHUNK;
+    conf.max_dirents = n + 2;
+    if (init_fs(POOL_CHUNK, POOL_CHUNK)) return 1;
+    root = inode_at(1);
+    rss0 = rss_bytes();
+
+    t0 = now();
+    for (i = 0; i < n; i++) {
+        struct nulnfs_dirent *d;
+        entry_name(buf, sizeof(buf), i, name_len);
+        d = alloc_dirent(buf, 1, 1);
+        if (d == NULL || insert_dirent_into_dirnode(d, root)) {
+            fprintf(stderr, "ERROR: out of dirents at %ld\n", i);
+            return 1;
+        };
+    };
+    t1 = now();
+    for (i = 0; i < n; i++) {
+        entry_name(buf, sizeof(buf), (i * 7919) % n, name_len);
+        if (find_dirent(root, buf) != NULL) found++;
+    };
+    t2 = now();
+
+    printf("entries:      %ld (names of %i bytes)\n", n, name_len);
+    printf("sizeof dirent: %zu\n", sizeof(struct nulnfs_dirent));
+    printf("name arena:   %llu bytes\n",
+        (unsigned long long) sb->name_arena_size);
+    printf("bytes/entry:  %.1f\n", (double) (rss_bytes() - rss0) / n);
+    printf("inserts/s:    %.0f\n", n / (t1 - t0));
+    printf("lookups/s:    %.0f (%ld found)\n", n / (t2 - t1), found);
+
+    return 0;
+}
+
+/* vi:set sw=4 et tw=72: */
@@ -0,0 +1,21 @@
+/*
+    Operation replay benchmark for nul1fs, see ops_replay.h.
+
+    usage: ops_nul1fs [max_entries [min_entries]]
+*/
+
+#define NULLFS_NO_MAIN
+#include "../nul1fs.c"
+#include "ops_replay.h"
+
+static struct fuse_lowlevel_ops *replay_setup(long n) {
+    (void) n;
+    start_t = time(NULL);
+    return &nullfs_oper;
+}
+
+int main(int argc, char *argv[]) {
+    return replay_main(argc, argv, "nul1fs");
+}
+
+/* vi:set sw=4 et tw=72: */
@@ -0,0 +1,21 @@
+/*
+    Operation replay benchmark for nullfs, see ops_replay.h.
+
+    usage: ops_nullfs [max_entries [min_entries]]
+*/
+
+#define NULLFS_NO_MAIN
+#include "../nullfs.c++"
+#include "ops_replay.h"
+
+static struct fuse_lowlevel_ops *replay_setup(long n) {
+    (void) n;
+    init_oper();
+    return &nullfs_oper;
+};
+
+int main(int argc, char *argv[]) {
+    return replay_main(argc, argv, "nullfs");
+};
+
+/* vi:set sw=4 et tw=72: */
@@ -0,0 +1,23 @@
+/*
+    Operation replay benchmark for nulnfs, see ops_replay.h. Pools
+    are sized to hold all entries, so no inodes get forgotten.
+
+    usage: ops_nulnfs [max_entries [min_entries]]
+*/
+
+#define NULLFS_NO_MAIN
+#include "../nulnfs.c"
+#include "ops_replay.h"
+
+static struct fuse_lowlevel_ops *replay_setup(long n) {
+    conf.max_inodes = n + POOL_CHUNK;
+    conf.max_dirents = n + POOL_CHUNK;
+    if (init_fs(POOL_CHUNK, POOL_CHUNK)) return NULL;
+    return &nullfs_ll_ops;
+}
+
+int main(int argc, char *argv[]) {
+    return replay_main(argc, argv, "nulnfs");
+}
+
+/* vi:set sw=4 et tw=72: */
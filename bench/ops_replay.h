@@ -0,0 +1,326 @@
+/*
+    Operation replay driver for in-process benchmarks.
+
+    Drives a daemon's fuse_lowlevel_ops table directly, with no
+    kernel and no /dev/fuse: fuse_reply_*() are replaced here by
+    stubs that only remember what the handler answered, so a reply
+    costs nothing and ops/s is the metadata engine alone.
+
+    For each size from min_entries to max_entries (times 10) a
+    forked child creates that many files in "/", then replays
+    lookup, getattr, readdir, rename, a mix (60% lookup, 20%
+    getattr, 10% unlink + create, 10% rename there and back) and
+    unlink, printing ops/s of each and resident memory per entry
+    after the creates. Ops a daemon lacks print as "-".
+
+    Included by bench/ops_<daemon> sources after the daemon itself,
+    which provide replay_setup(n): initialize the daemon for n
+    entries and return its ops table.
+*/
+
+#ifndef _NULLFS_OPS_REPLAY_H
+#define _NULLFS_OPS_REPLAY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static struct fuse_lowlevel_ops *replay_setup(long n);
+
+/* last reply */
+static int replay_err;
+static fuse_ino_t replay_ino;
+static size_t replay_len;
+static char replay_buf[1 << 16];
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int fuse_reply_err(fuse_req_t req, int err) {
+    (void) req;
+    replay_err = err;
+    return 0;
+}
+
+void fuse_reply_none(fuse_req_t req) {
+    (void) req;
+    replay_err = 0;
+}
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e) {
+    (void) req;
+    replay_err = 0;
+    replay_ino = e->ino;
+    return 0;
+}
+
+int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e,
+const struct fuse_file_info *fi) {
+    (void) fi;
+    return fuse_reply_entry(req, e);
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr,
+double attr_timeout) {
+    (void) req;
+    (void) attr_timeout;
+    replay_err = 0;
+    replay_ino = attr->st_ino;
+    return 0;
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi) {
+    (void) req;
+    (void) fi;
+    replay_err = 0;
+    return 0;
+}
+
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size) {
+    (void) req;
+    replay_err = 0;
+    replay_len = size;
+    if (buf != NULL && size <= sizeof(replay_buf))
+        memcpy(replay_buf, buf, size);
+    return 0;
+}
+
+int fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count) {
+    (void) iov;
+    (void) count;
+    return fuse_reply_buf(req, NULL, 0);
+}
+
+int fuse_reply_write(fuse_req_t req, size_t count) {
+    (void) req;
+    replay_err = 0;
+    replay_len = count;
+    return 0;
+}
+
+int fuse_reply_lseek(fuse_req_t req, off_t off) {
+    (void) req;
+    (void) off;
+    replay_err = 0;
+    return 0;
+}
+
+const struct fuse_ctx *fuse_req_ctx(fuse_req_t req) {
+    (void) req;
+    return NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+static double replay_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long replay_rss(void) {
+    long pages = 0, rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2) rss = 0;
+    fclose(f);
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+static const char *replay_name(char *buf, const char *prefix, long i) {
+    snprintf(buf, 32, "%s%ld", prefix, i);
+    return buf;
+}
+
+static uint64_t replay_rand(uint64_t *x) {
+    *x = *x * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *x >> 33;
+}
+
+static void replay_report(const char *op, long n, double t) {
+    if (t < 0) printf("  %-10s %12s\n", op, "-");
+    else printf("  %-10s %12.0f ops/s\n", op, n / t);
+}
+
+/* creates file i, remembering its inode number and reference */
+static int replay_create(struct fuse_lowlevel_ops *ops,
+fuse_ino_t *inos, long i) {
+    struct fuse_file_info fi;
+    char name[32];
+
+    memset(&fi, 0, sizeof(fi));
+    replay_name(name, "f", i);
+    replay_err = -1;
+    if (ops->create != NULL)
+        ops->create(NULL, FUSE_ROOT_ID, name, S_IFREG | 0644, &fi);
+    else
+        ops->mknod(NULL, FUSE_ROOT_ID, name, S_IFREG | 0644, 0);
+    if (replay_err != 0) return 0;
+    inos[i] = replay_ino;
+    return 1;
+}
+
+static void replay_forget(struct fuse_lowlevel_ops *ops,
+fuse_ino_t ino) {
+    if (ops->forget != NULL) ops->forget(NULL, ino, 1);
+}
+
+static int replay_rename(struct fuse_lowlevel_ops *ops, long i,
+int back) {
+    char from[32], to[32];
+
+    replay_name(back ? from : to, "r", i);
+    replay_name(back ? to : from, "f", i);
+    ops->rename(NULL, FUSE_ROOT_ID, from, FUSE_ROOT_ID, to, 0);
+    return replay_err == 0;
+}
+
+/* one readdir pass over "/", returns entries seen */
+static long replay_readdir(struct fuse_lowlevel_ops *ops) {
+    struct fuse_file_info fi;
+    off_t off = 0;
+    long n = 0;
+
+    memset(&fi, 0, sizeof(fi));
+    if (ops->opendir != NULL) ops->opendir(NULL, FUSE_ROOT_ID, &fi);
+    for (;;) {
+        size_t p = 0;
+        replay_len = 0;
+        ops->readdir(NULL, FUSE_ROOT_ID, sizeof(replay_buf), off, &fi);
+        if (replay_err != 0 || replay_len == 0) break;
+        /* struct fuse_dirent: ino, off, namelen, type, name */
+        while (p + 24 <= replay_len) {
+            uint32_t namelen;
+            memcpy(&off, replay_buf + p + 8, sizeof(off));
+            memcpy(&namelen, replay_buf + p + 16, sizeof(namelen));
+            p += (24 + namelen + 7) & ~(size_t) 7;
+            n++;
+        }
+    }
+    if (ops->releasedir != NULL)
+        ops->releasedir(NULL, FUSE_ROOT_ID, &fi);
+    return n;
+}
+
+static int replay_run(const char *fs, long n) {
+    struct fuse_lowlevel_ops *ops;
+    struct fuse_conn_info conn;
+    fuse_ino_t *inos;
+    uint64_t x = 1;
+    long rss0, i, k, done, listed;
+    char name[32];
+    double t;
+
+    inos = (fuse_ino_t *) calloc(n, sizeof(*inos));
+    if (inos == NULL) return 1;
+    memset(inos, 0, n * sizeof(*inos));
+    ops = replay_setup(n);
+    if (ops == NULL) return 1;
+    memset(&conn, 0, sizeof(conn));
+    if (ops->init != NULL) ops->init(NULL, &conn);
+    rss0 = replay_rss();
+
+    printf("%s, %ld entries\n", fs, n);
+    t = replay_now();
+    for (i = 0; i < n; i++)
+        if (! replay_create(ops, inos, i)) {
+            fprintf(stderr, "ERROR: create f%ld: %s\n", i,
+                strerror(replay_err));
+            return 1;
+        }
+    t = replay_now() - t;
+    replay_report("create", n, t);
+    printf("  %-10s %12.1f bytes/entry\n", "memory",
+        (double) (replay_rss() - rss0) / n);
+
+    t = replay_now();
+    for (i = 0; i < n; i++) {
+        k = replay_rand(&x) % n;
+        ops->lookup(NULL, FUSE_ROOT_ID, replay_name(name, "f", k));
+        if (replay_err == 0) replay_forget(ops, replay_ino);
+    }
+    replay_report("lookup", n, replay_now() - t);
+
+    t = replay_now();
+    for (i = 0; i < n; i++)
+        ops->getattr(NULL, inos[replay_rand(&x) % n], NULL);
+    replay_report("getattr", n, replay_now() - t);
+
+    t = replay_now();
+    listed = replay_readdir(ops);
+    t = replay_now() - t;
+    if (listed > 0) replay_report("readdir", listed, t);
+    else replay_report("readdir", 0, -1);
+
+    if (ops->rename != NULL) {
+        t = replay_now();
+        for (i = 0; i < n; i++) replay_rename(ops, i, 0);
+        for (i = 0; i < n; i++) replay_rename(ops, i, 1);
+        replay_report("rename", 2 * n, replay_now() - t);
+    } else {
+        replay_report("rename", 0, -1);
+    }
+
+    t = replay_now();
+    for (i = done = 0; i < n; i++) {
+        int r = replay_rand(&x) % 10;
+        k = replay_rand(&x) % n;
+        if (r < 6) {
+            ops->lookup(NULL, FUSE_ROOT_ID, replay_name(name, "f", k));
+            if (replay_err == 0) replay_forget(ops, replay_ino);
+            done++;
+        } else if (r < 8) {
+            ops->getattr(NULL, inos[k], NULL);
+            done++;
+        } else if (r == 8) {
+            ops->unlink(NULL, FUSE_ROOT_ID, replay_name(name, "f", k));
+            replay_forget(ops, inos[k]);
+            replay_create(ops, inos, k);
+            done += 2;
+        } else if (ops->rename != NULL) {
+            replay_rename(ops, k, 0);
+            replay_rename(ops, k, 1);
+            done += 2;
+        }
+    }
+    replay_report("mix", done, replay_now() - t);
+
+    t = replay_now();
+    for (i = 0; i < n; i++)
+        ops->unlink(NULL, FUSE_ROOT_ID, replay_name(name, "f", i));
+    replay_report("unlink", n, replay_now() - t);
+
+    for (i = 0; i < n; i++) replay_forget(ops, inos[i]);
+    free(inos);
+    return 0;
+}
+
+static int replay_main(int argc, char *argv[], const char *fs) {
+    long max = argc > 1 ? atol(argv[1]) : 1000000;
+    long min = argc > 2 ? atol(argv[2]) : 1000;
+    long n;
+
+    if (min < 1) min = 1;
+    for (n = min; n <= max; n *= 10) {
+        pid_t pid;
+        int status;
+
+        fflush(stdout);
+        pid = fork();
+        if (pid < 0) return 1;
+        if (pid == 0) exit(replay_run(fs, n));
+        if (waitpid(pid, &status, 0) < 0 || status != 0) return 1;
+    }
+    return 0;
+}
+
+#endif /* _NULLFS_OPS_REPLAY_H */
+
+/* vi:set sw=4 et tw=72: */
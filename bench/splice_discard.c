@@ -0,0 +1,76 @@
+/*
+    Write discard throughput: copying path vs. splice to /dev/null.
+
+    Pushes size bytes through a pipe in requests of req_size bytes,
+    standing in for /dev/fuse, and drains every request either by
+    read() into a buffer (what libfuse does for the write handler)
+    or by splice() into /dev/null (what write_buf does with
+    FUSE_CAP_SPLICE_READ). Reports GB/s for both.
+
+    usage: splice_discard [req_size [size_mb]]
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double run(int use_splice, size_t req_size, size_t size) {
+    char *src = malloc(req_size), *dst = malloc(req_size);
+    int p[2], devnull = open("/dev/null", O_WRONLY);
+    size_t done;
+    double t0;
+
+    if (src == NULL || dst == NULL || devnull < 0 || pipe(p) != 0) {
+        perror("splice_discard");
+        exit(1);
+    };
+    fcntl(p[1], F_SETPIPE_SZ, (int) req_size);
+    memset(src, 'x', req_size);
+
+    t0 = now();
+    for (done = 0; done < size; done += req_size) {
+        size_t n;
+        for (n = 0; n < req_size; ) {
+            ssize_t w = write(p[1], src + n, req_size - n), r;
+            if (w <= 0) break;
+            n += w;
+            for (; w > 0; w -= r) {
+                r = use_splice
+                    ? splice(p[0], NULL, devnull, NULL, w, 0)
+                    : read(p[0], dst, w);
+                if (r <= 0) break;
+            };
+        };
+    };
+    t0 = now() - t0;
+
+    close(p[0]);
+    close(p[1]);
+    close(devnull);
+    free(src);
+    free(dst);
+    return size / t0 / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    size_t req_size = argc > 1 ? (size_t) atol(argv[1]) : 131072;
+    size_t size = (argc > 2 ? (size_t) atol(argv[2]) : 4096) << 20;
+
+    printf("request size: %zu\n", req_size);
+    printf("read():       %.2f GB/s\n", run(0, req_size, size));
+    printf("splice():     %.2f GB/s\n", run(1, req_size, size));
+
+    return 0;
+}
+
+/* vi:set sw=4 et tw=72: */
@@ -0,0 +1,68 @@
+/*
+    Memory footprint benchmark for nullfs directory tree.
+
+    Creates n_files files spread over directories of fanout entries
+    each in nullfs.c++ tree and reports resident memory per file,
+    create rate and time to walk one directory's children.
+
+    usage: tree_mem [n_files [fanout]]
+*/
+
+#define NULLFS_NO_MAIN
+#include "../nullfs.c++"
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+};
+
+static long rss_bytes(void) {
+    long pages = 0, rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2) rss = 0;
+    fclose(f);
+    return rss * sysconf(_SC_PAGESIZE);
+};
+
+int main(int argc, char *argv[]) {
+    long n_files = argc > 1 ? atol(argv[1]) : 1000000;
+    long fanout = argc > 2 ? atol(argv[2]) : 1000;
+    long rss0 = rss_bytes();
+    long n_listed = 0;
+    char buf[64];
+    node *d0 = NULL, *dir = NULL, *n;
+    double t0, t1, t2;
+
+    t0 = now();
+    for (long i = 0; i < n_files; i++) {
+        if (i % fanout == 0) {
+            snprintf(buf, sizeof(buf), "d%ld", i / fanout);
+            if (dir && dir != d0) put_node(dir);
+            add_node(root, buf, NULLFS_DIR, &dir);
+            if (d0 == NULL) d0 = dir;
+        };
+        snprintf(buf, sizeof(buf), "file%ld", i);
+        if (add_node(dir, buf, NULLFS_FILE, &n) >= 0) put_node(n);
+    };
+    t1 = now();
+    pthread_rwlock_rdlock(dir_lock(d0));
+    for (n = d0->children; n; n = n->next) n_listed++;
+    pthread_rwlock_unlock(dir_lock(d0));
+    t2 = now();
+
+    printf("files:        %ld (%ld per dir)\n", n_files, fanout);
+    printf("bytes/file:   %.1f\n", (double) (rss_bytes() - rss0) / n_files);
+    printf("creates/s:    %.0f\n", n_files / (t1 - t0));
+    printf("list /d0:     %ld entries in %.1f us\n", n_listed,
+        (t2 - t1) * 1e6);
+
+    return 0;
+};
+
+/* vi:set sw=4 et tw=72: */
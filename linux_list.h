@@ -8,6 +8,14 @@
  * [http://lxr.linux.no/#linux+v2.6.33/include/linux/list.h].
  *
  * `list_entry' is redefined without `container_of' macro.
+ *
+ * Links are stored as byte offsets from the link itself rather than
+ * as pointers, so lists stay valid wherever the memory holding them
+ * is mapped, as long as all of a list is in one mapping. An empty
+ * list_head points to itself, which is offset 0, and an hlist link
+ * of 0 is NULL (no hlist link ever points to itself), so zeroed
+ * memory holds initialized, empty lists. Use list_next() and
+ * list_prev() instead of ->next and ->prev.
  */
 
 /*
@@ -21,28 +29,44 @@
  */
 
 struct list_head {
-	struct list_head *next, *prev;
+	ptrdiff_t next, prev;
 };
 
-#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD_INIT(name) { 0, 0 }
 
 #define LIST_HEAD(name) \
 	struct list_head name = LIST_HEAD_INIT(name)
 
+#define __list_link(from, to) ((char *)(to) - (char *)(from))
+#define list_next(h) ((struct list_head *)((char *)(h) + (h)->next))
+#define list_prev(h) ((struct list_head *)((char *)(h) + (h)->prev))
+
 static inline void INIT_LIST_HEAD(struct list_head *list)
 {
-	list->next = list;
-	list->prev = list;
+	list->next = 0;
+	list->prev = 0;
+}
+
+static inline void __list_set_next(struct list_head *h,
+				   struct list_head *next)
+{
+	h->next = __list_link(h, next);
+}
+
+static inline void __list_set_prev(struct list_head *h,
+				   struct list_head *prev)
+{
+	h->prev = __list_link(h, prev);
 }
 
 static inline void __list_add(struct list_head *new,
 			      struct list_head *prev,
 			      struct list_head *next)
 {
-	next->prev = new;
-	new->next = next;
-	new->prev = prev;
-	prev->next = new;
+	__list_set_prev(next, new);
+	__list_set_next(new, next);
+	__list_set_prev(new, prev);
+	__list_set_next(prev, new);
 }
 
 /**
@@ -55,7 +79,7 @@ static inline void __list_add(struct list_head *new,
  */
 static inline void list_add(struct list_head *new, struct list_head *head)
 {
-	__list_add(new, head, head->next);
+	__list_add(new, head, list_next(head));
 }
 
 /**
@@ -68,7 +92,7 @@ static inline void list_add(struct list_head *new, struct list_head *head)
  */
 static inline void list_add_tail(struct list_head *new, struct list_head *head)
 {
-	__list_add(new, head->prev, head);
+	__list_add(new, list_prev(head), head);
 }
 
 /*
@@ -80,8 +104,8 @@ static inline void list_add_tail(struct list_head *new, struct list_head *head)
  */
 static inline void __list_del(struct list_head *prev, struct list_head *next)
 {
-	next->prev = prev;
-	prev->next = next;
+	__list_set_prev(next, prev);
+	__list_set_next(prev, next);
 }
 
 /**
@@ -90,7 +114,7 @@ static inline void __list_del(struct list_head *prev, struct list_head *next)
  */
 static inline void list_del_init(struct list_head *entry)
 {
-	__list_del(entry->prev, entry->next);
+	__list_del(list_prev(entry), list_next(entry));
 	INIT_LIST_HEAD(entry);
 }
 
@@ -104,10 +128,10 @@ static inline void list_del_init(struct list_head *entry)
 static inline void list_replace(struct list_head *old,
 				struct list_head *new)
 {
-	new->next = old->next;
-	new->next->prev = new;
-	new->prev = old->prev;
-	new->prev->next = new;
+	__list_set_next(new, list_next(old));
+	__list_set_prev(list_next(new), new);
+	__list_set_prev(new, list_prev(old));
+	__list_set_next(list_prev(new), new);
 }
 
 static inline void list_replace_init(struct list_head *old,
@@ -124,7 +148,7 @@ static inline void list_replace_init(struct list_head *old,
  */
 static inline void list_move(struct list_head *list, struct list_head *head)
 {
-        __list_del(list->prev, list->next);
+        __list_del(list_prev(list), list_next(list));
         list_add(list, head);
 }
 
@@ -136,7 +160,7 @@ static inline void list_move(struct list_head *list, struct list_head *head)
 static inline void list_move_tail(struct list_head *list,
 				  struct list_head *head)
 {
-        __list_del(list->prev, list->next);
+        __list_del(list_prev(list), list_next(list));
         list_add_tail(list, head);
 }
 
@@ -148,7 +172,7 @@ static inline void list_move_tail(struct list_head *list,
 static inline int list_is_last(const struct list_head *list,
 			       const struct list_head *head)
 {
-	return list->next == head;
+	return list_next(list) == head;
 }
 
 /**
@@ -157,7 +181,7 @@ static inline int list_is_last(const struct list_head *list,
  */
 static inline int list_empty(const struct list_head *head)
 {
-	return head->next == head;
+	return head->next == 0;
 }
 
 /**
@@ -192,7 +216,7 @@ static inline int list_empty(const struct list_head *head)
  * Note, that list is expected to be not empty.
  */
 #define list_first_entry(ptr, type, member) \
-	list_entry((ptr)->next, type, member)
+	list_entry(list_next(ptr), type, member)
 
 /**
  * __list_for_each - iterate over a list
@@ -205,7 +229,7 @@ static inline int list_empty(const struct list_head *head)
  * or 1 entry) most of the time.
  */
 #define __list_for_each(pos, head) \
-	for (pos = (head)->next; pos != (head); pos = pos->next)
+	for (pos = list_next(head); pos != (head); pos = list_next(pos))
 
 /**
  * list_for_each_entry	-	iterate over list of given type
@@ -214,9 +238,121 @@ static inline int list_empty(const struct list_head *head)
  * @member:	the name of the list_struct within the struct.
  */
 #define __list_for_each_entry(pos, head, member)			\
-	for (pos = list_entry((head)->next, typeof(*pos), member);	\
+	for (pos = list_entry(list_next(head), typeof(*pos), member);	\
 	     &pos->member != (head);					\
-	     pos = list_entry(pos->member.next, typeof(*pos), member))
+	     pos = list_entry(list_next(&pos->member), typeof(*pos), member))
+
+/*
+ * Double linked lists with a single pointer list head.
+ * Mostly useful for hash tables where the two pointer list head is
+ * too wasteful.
+ * You lose the ability to access the tail in O(1).
+ */
+
+/*
+ * first and next are links to an hlist_node, pprev is a link to the
+ * first or next field linking to this node.
+ */
+struct hlist_head {
+	ptrdiff_t first;
+};
+
+struct hlist_node {
+	ptrdiff_t next, pprev;
+};
+
+#define HLIST_HEAD_INIT { .first = 0 }
+#define HLIST_HEAD(name) struct hlist_head name = {  .first = 0 }
+#define INIT_HLIST_HEAD(ptr) ((ptr)->first = 0)
+
+/* follows link at *l, NULL for 0 */
+static inline void *__hlist_get(const ptrdiff_t *l)
+{
+	return *l ? (char *)l + *l : NULL;
+}
+
+static inline void __hlist_set(ptrdiff_t *l, const void *to)
+{
+	*l = to ? __list_link(l, to) : 0;
+}
+
+#define hlist_first(h) ((struct hlist_node *)__hlist_get(&(h)->first))
+#define hlist_next(n) ((struct hlist_node *)__hlist_get(&(n)->next))
+
+static inline void INIT_HLIST_NODE(struct hlist_node *h)
+{
+	h->next = 0;
+	h->pprev = 0;
+}
+
+static inline int hlist_unhashed(const struct hlist_node *h)
+{
+	return !h->pprev;
+}
+
+static inline int hlist_empty(const struct hlist_head *h)
+{
+	return !h->first;
+}
+
+static inline void __hlist_del(struct hlist_node *n)
+{
+	struct hlist_node *next = hlist_next(n);
+	ptrdiff_t *pprev = (ptrdiff_t *)__hlist_get(&n->pprev);
+	__hlist_set(pprev, next);
+	if (next)
+		__hlist_set(&next->pprev, pprev);
+}
+
+static inline void hlist_del_init(struct hlist_node *n)
+{
+	if (!hlist_unhashed(n)) {
+		__hlist_del(n);
+		INIT_HLIST_NODE(n);
+	}
+}
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = hlist_first(h);
+	__hlist_set(&n->next, first);
+	if (first)
+		__hlist_set(&first->pprev, &n->next);
+	__hlist_set(&h->first, n);
+	__hlist_set(&n->pprev, &h->first);
+}
+
+#define hlist_entry(ptr, type, member) container_of(ptr,type,member)
+
+#define hlist_for_each(pos, head) \
+	for (pos = hlist_first(head); pos; pos = hlist_next(pos))
+
+/**
+ * hlist_for_each_entry	- iterate over list of given type
+ * @tpos:	the type * to use as a loop cursor.
+ * @pos:	the &struct hlist_node to use as a loop cursor.
+ * @head:	the head for your list.
+ * @member:	the name of the hlist_node within the struct.
+ */
+#define hlist_for_each_entry(tpos, pos, head, member)			 \
+	for (pos = hlist_first(head);					 \
+	     pos &&							 \
+		({ tpos = hlist_entry(pos, typeof(*tpos), member); 1;}); \
+	     pos = hlist_next(pos))
+
+/**
+ * hlist_for_each_entry_safe - iterate over list of given type safe against removal of list entry
+ * @tpos:	the type * to use as a loop cursor.
+ * @pos:	the &struct hlist_node to use as a loop cursor.
+ * @n:		another &struct hlist_node to use as temporary storage
+ * @head:	the head for your list.
+ * @member:	the name of the hlist_node within the struct.
+ */
+#define hlist_for_each_entry_safe(tpos, pos, n, head, member) 		 \
+	for (pos = hlist_first(head);					 \
+	     pos && ({ n = hlist_next(pos); 1; }) && 			 \
+		({ tpos = hlist_entry(pos, typeof(*tpos), member); 1;}); \
+	     pos = n)
 
 /* vi:set sw=8 noet ts=8: */
 #endif /* _LIST_H */
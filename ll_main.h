@@ -0,0 +1,115 @@
+/*
+    Common main loop of nullfs daemons: parses standard fuse command
+    line, mounts the low-level session and serves it with a pool of
+    worker threads. Number of workers is set by "-o max_threads=N"
+    (and "-o max_idle_threads=N"), "-s" serves requests in a single
+    thread. Each worker reads its own clone of /dev/fuse, so requests
+    aren't funneled through one queue.
+
+    ll_init(), called from daemons' init handlers, tunes the
+    connection for streaming: largest writes, deep background queue,
+    async reads and parallel directory operations. libfuse's
+    connection options (max_write=, max_background=,
+    congestion_threshold=, sync_read, ...) and no_parallel_dirops
+    override these defaults.
+*/
+
+#ifndef _NULLFS_LL_MAIN_H
+#define _NULLFS_LL_MAIN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* 256 pages is the kernel's default max_pages limit; libfuse lowers
+   max_write to what fits its request buffer */
+#define LL_MAX_WRITE (256 * 4096)
+#define LL_MAX_BACKGROUND 128
+#define LL_CONGESTION_THRESHOLD 96
+
+static struct fuse_conn_info_opts *ll_conn_opts = NULL;
+static struct fuse_session *ll_se = NULL;   /* for notifications */
+static int ll_serial_dirops = 0;
+
+static const struct fuse_opt ll_opts[] = {
+    {"no_parallel_dirops", 0, 1},
+    FUSE_OPT_END
+};
+
+static inline void ll_init(struct fuse_conn_info *conn) {
+    conn->max_write = LL_MAX_WRITE;
+    conn->max_background = LL_MAX_BACKGROUND;
+    conn->congestion_threshold = LL_CONGESTION_THRESHOLD;
+    if (conn->capable & FUSE_CAP_ASYNC_READ)
+        conn->want |= FUSE_CAP_ASYNC_READ;
+    if (! ll_serial_dirops
+    && (conn->capable & FUSE_CAP_PARALLEL_DIROPS))
+        conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+    else
+        conn->want &= ~FUSE_CAP_PARALLEL_DIROPS;
+    if (ll_conn_opts != NULL)
+        fuse_apply_conn_info_opts(ll_conn_opts, conn);
+}
+
+static inline int ll_main(struct fuse_args *args,
+const struct fuse_lowlevel_ops *ops, size_t ops_size) {
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
+    int res = 1;
+
+    if (fuse_opt_parse(args, &ll_serial_dirops, ll_opts, NULL) == -1)
+        return 1;
+    ll_conn_opts = fuse_parse_conn_info_opts(args);
+    if (ll_conn_opts == NULL) return 1;
+    if (fuse_parse_cmdline(args, &opts) != 0) return 1;
+    if (opts.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", args->argv[0]);
+        printf("    -o no_parallel_dirops  serialize directory ops\n"
+            "    -o max_write=N, max_background=N, congestion_threshold=N,"
+            "\n       sync_read: override connection defaults\n");
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        res = 0;
+        goto LL_MAIN_OUT;
+    } else if (opts.show_version) {
+        fuse_lowlevel_version();
+        res = 0;
+        goto LL_MAIN_OUT;
+    } else if (opts.mountpoint == NULL) {
+        fprintf(stderr, "usage: %s [options] <mountpoint>\n",
+            args->argv[0]);
+        goto LL_MAIN_OUT;
+    };
+
+    se = fuse_session_new(args, ops, ops_size, NULL);
+    if (se == NULL) goto LL_MAIN_OUT;
+    ll_se = se;
+    if (fuse_set_signal_handlers(se) == 0) {
+        if (fuse_session_mount(se, opts.mountpoint) == 0) {
+            fuse_daemonize(opts.foreground);
+            if (opts.singlethread) {
+                res = fuse_session_loop(se);
+            } else {
+                struct fuse_loop_config *cfg = fuse_loop_cfg_create();
+                fuse_loop_cfg_set_clone_fd(cfg, 1);
+                fuse_loop_cfg_set_max_threads(cfg, opts.max_threads);
+                fuse_loop_cfg_set_idle_threads(cfg,
+                    opts.max_idle_threads);
+                res = fuse_session_loop_mt(se, cfg);
+                fuse_loop_cfg_destroy(cfg);
+            };
+            fuse_session_unmount(se);
+        };
+        fuse_remove_signal_handlers(se);
+    };
+    fuse_session_destroy(se);
+
+LL_MAIN_OUT:
+    free(ll_conn_opts);
+    free(opts.mountpoint);
+    fuse_opt_free_args(args);
+    return res;
+}
+
+#endif /* _NULLFS_LL_MAIN_H */
+
+/* vi:set sw=4 et tw=72: */
@@ -7,168 +7,686 @@
 */
 
 #define _FILE_OFFSET_BITS 64
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 312
 #include <sys/stat.h>
 #include <time.h>
-#include <fuse.h>
+#include <fuse3/fuse_lowlevel.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include "ll_main.h"
+#include "nullfs_io.h"
+#include "nullfs_stats.h"
+#include "nullfs_delay.h"
+#include "nullfs_rules.h"
+#include "nullfs_csum.h"
 
 time_t start_t;
 
-static int strendswith(const char *str, const char *sfx) {
-    size_t sfx_len = strlen(sfx);
-    size_t str_len = strlen(str);
-    if (str_len < sfx_len) return 0;
-    return (strncmp(str + (str_len - sfx_len), sfx, sfx_len) == 0);
+/* file timestamps come from a clock picked per mount: time()
+   ("-o clock=time"), CLOCK_REALTIME_COARSE (default) or a value a
+   ticker thread refreshes every tick_ms ("-o clock=tick"), which
+   costs one atomic load. atime is "now"; mtime and ctime are when
+   the file was last written or truncated, kept with its size, or
+   mount time for files with no size. Nanoseconds are reported with
+   "-o nsec", otherwise they're 0. */
+enum nul1fs_clock { STAMP_COARSE = 0, STAMP_TIME, STAMP_TICK };
+
+struct nul1fs_config {
+    int clock;
+    int nsec;
+    unsigned tick_ms;
 };
 
-static int nullfs_isdir(const char *path) {
-    if (! path) return 0;
-    return (strendswith(path, "/") || strendswith(path, "/..")
-        || strendswith(path, "/.") || (strcmp(path, "..") == 0)
-        || (strcmp(path, ".") == 0));
+static struct nul1fs_config conf = { STAMP_COARSE, 0, 10 };
+
+#define NUL1FS_OPT(t, p, v) { t, offsetof(struct nul1fs_config, p), v }
+static const struct fuse_opt nul1fs_opts[] = {
+    NUL1FS_OPT("clock=coarse", clock, STAMP_COARSE),
+    NUL1FS_OPT("clock=time", clock, STAMP_TIME),
+    NUL1FS_OPT("clock=tick", clock, STAMP_TICK),
+    NUL1FS_OPT("tick_ms=%u", tick_ms, 0),
+    NUL1FS_OPT("nsec", nsec, 1),
+    FUSE_OPT_END
+};
+
+/* ticker's reading: seconds << 30 | nanoseconds */
+static uint64_t stamp;
+
+static uint64_t stamp_read(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec << 30 | ts.tv_nsec;
+};
+
+static void *stamp_thread(void *arg) {
+    struct timespec tick;
+    (void) arg;
+
+    tick.tv_sec = conf.tick_ms / 1000;
+    tick.tv_nsec = (conf.tick_ms % 1000) * 1000000L;
+    for (;;) {
+        nanosleep(&tick, NULL);
+        __atomic_store_n(&stamp, stamp_read(), __ATOMIC_RELAXED);
+    };
+    return NULL;
+};
+
+static void stamp_init(void) {
+    pthread_t t;
+
+    if (conf.clock != STAMP_TICK) return;
+    if (conf.tick_ms == 0) conf.tick_ms = 1;
+    stamp = stamp_read();
+    if (pthread_create(&t, NULL, stamp_thread, NULL) == 0)
+        pthread_detach(t);
+    else
+        conf.clock = STAMP_COARSE;
+};
+
+/* reading of the mount's clock, packed like stamp */
+static uint64_t stamp_get(void) {
+    struct timespec ts;
+
+    switch (conf.clock) {
+    case STAMP_TICK:
+        return __atomic_load_n(&stamp, __ATOMIC_RELAXED);
+    case STAMP_TIME:
+        return (uint64_t) time(NULL) << 30;
+    default:
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        return (uint64_t) ts.tv_sec << 30 | ts.tv_nsec;
+    };
+};
+
+static void stamp_unpack(uint64_t s, struct timespec *ts) {
+    ts->tv_sec = s >> 30;
+    ts->tv_nsec = conf.nsec ? (long) (s & ((1 << 30) - 1)) : 0;
+};
+
+static void stamp_now(struct timespec *ts) {
+    stamp_unpack(stamp_get(), ts);
+};
+
+/* nul1fs keeps no state: "/" is the only directory and any name in
+   it is a file. file's inode number is made from its name, so that
+   the kernel sees different names as different files. The only
+   thing remembered is size of files that have been written to.
+   Two inode numbers at the top are left for /.nullfs/stats.
+
+   Path rules apply to names in "/". What a rule makes of the name
+   is kept in the low bits of its inode number, so later requests
+   on the inode don't need the name: "dir" names are empty
+   directories, like "/" itself (inode 1) */
+enum { INO_FILE = 0, INO_DIR, INO_DISCARD, INO_COUNT };
+#define INO_KIND(ino) ((ino) & 3)
+
+/* inode number of name in "/", hashed in the same pass that runs
+   the rules; sets *action */
+static fuse_ino_t nullfs_name_ino(const char *name, int *action) {
+    static const unsigned char kinds[] = { INO_FILE, INO_FILE, INO_DIR,
+        INO_FILE, INO_DISCARD, INO_COUNT, INO_FILE };
+    uint64_t h = 0xcbf29ce484222325ULL;
+    unsigned st = rules.start ? rules_step1(rules.start, '/') : 0;
+
+    for (; *name; name++) {
+        h = (h ^ (unsigned char) *name) * 0x100000001b3ULL;
+        if (st) st = rules_step1(st, (unsigned char) *name);
+    };
+    *action = rules_action(st);
+    h = (h & ~(uint64_t) 3) | kinds[*action];
+    return (h <= FUSE_ROOT_ID || h >= STATS_FILE_INO) ? h ^ 4 : h;
+};
+
+/* file sizes: open addressing table with linear probing. Sizes of
+   files already in it are read, set and grown lock-free: a reader
+   announces itself in its thread's counter, loads the table and
+   works on the slot with atomics. Adding a file, removing one
+   (size set to 0, unlink, rename away) and rebuilding the table
+   take size_lock. Removed files leave a tombstone, which readers
+   step over and only a rebuild clears, so a slot never changes
+   owner under a reader. The table is rebuilt at a quarter full
+   when live slots and tombstones would fill half of it: sizes are
+   frozen slot by slot while they're copied (readers wanting to
+   change one wait for the new table), the new table is published,
+   and the old one freed once every reader that could have seen it
+   has left. when no table can be had, setting a size fails with
+   ENOSPC */
+#define SIZE_BITS 16            /* smallest table */
+#define SIZE_TOMB FUSE_ROOT_ID  /* removed; "/" has no size */
+#define SIZE_MOVED ((off_t) 1 << 62)    /* copied to a new table */
+#define SIZE_STRIPES 64
+
+struct size_slot {
+    fuse_ino_t ino;     /* 0 in free slot */
+    off_t size;
+    uint64_t mtime;     /* packed like stamp */
+};
+
+struct size_table {
+    unsigned bits;
+    size_t used;        /* live slots and tombstones */
+    size_t live;
+    struct size_slot slot[];
+};
+
+/* readers in the table, by epoch parity and thread */
+struct size_readers {
+    long n;
+} __attribute__((aligned(64)));
+
+static struct size_table *sizes = NULL;
+static struct size_readers size_readers[2][SIZE_STRIPES];
+static unsigned size_epoch = 0;
+static unsigned size_stripes = 0;
+static __thread int size_stripe = -1;
+static pthread_mutex_t size_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t size_home(fuse_ino_t ino, unsigned bits) {
+    return (size_t) (((uint64_t) ino * 0x9e3779b97f4a7c15ULL)
+        >> (64 - bits));
+};
+
+/* starts a lock-free use of the table; returns its counter */
+static long *size_enter(void) {
+    long *n;
+
+    if (size_stripe < 0)
+        size_stripe = __atomic_fetch_add(&size_stripes, 1,
+            __ATOMIC_RELAXED) % SIZE_STRIPES;
+    n = &size_readers[__atomic_load_n(&size_epoch, __ATOMIC_SEQ_CST)
+        & 1][size_stripe].n;
+    __atomic_add_fetch(n, 1, __ATOMIC_SEQ_CST);
+    return n;
+};
+
+static void size_leave(long *n) {
+    __atomic_sub_fetch(n, 1, __ATOMIC_SEQ_CST);
+};
+
+/* waits until nobody can be using a table unpublished before the
+   call: every reader which entered in either epoch has left */
+static void size_sync(void) {
+    for (int k = 0; k < 2; k++) {
+        unsigned e = __atomic_fetch_add(&size_epoch, 1,
+            __ATOMIC_SEQ_CST) & 1;
+        for (int i = 0; i < SIZE_STRIPES; i++)
+            while (__atomic_load_n(&size_readers[e][i].n,
+            __ATOMIC_SEQ_CST))
+                sched_yield();
+    };
+};
+
+/* ino's slot in t, or NULL */
+static struct size_slot *size_find(struct size_table *t, fuse_ino_t ino) {
+    size_t mask, i;
+
+    if (t == NULL) return NULL;
+    mask = ((size_t) 1 << t->bits) - 1;
+    for (i = size_home(ino, t->bits);; i = (i + 1) & mask) {
+        fuse_ino_t cur = __atomic_load_n(&t->slot[i].ino,
+            __ATOMIC_ACQUIRE);
+        if (cur == ino) return &t->slot[i];
+        if (cur == 0) return NULL;
+    };
+};
+
+/* fills ino's new slot in t; caller holds size_lock */
+static void size_insert(struct size_table *t, fuse_ino_t ino, off_t size,
+uint64_t mtime) {
+    size_t mask = ((size_t) 1 << t->bits) - 1;
+    size_t i = size_home(ino, t->bits);
+
+    while (t->slot[i].ino != 0) i = (i + 1) & mask;
+    t->slot[i].size = size;
+    t->slot[i].mtime = mtime;
+    __atomic_store_n(&t->slot[i].ino, ino, __ATOMIC_RELEASE);
+    t->used++;
+    t->live++;
+};
+
+/* makes room for one more file, rebuilding the table if needed;
+   caller holds size_lock. returns 0 or -ENOSPC */
+static int size_reserve(void) {
+    struct size_table *old = sizes, *t;
+    size_t live = old ? old->live + 1 : 1;
+    unsigned bits = SIZE_BITS;
+
+    if (old != NULL && (old->used + 1) * 2 <= (size_t) 1 << old->bits)
+        return 0;
+    while (((size_t) 1 << bits) < live * 4) bits++;
+    if (bits >= 8 * sizeof(size_t) - 5) return -ENOSPC;
+    t = (struct size_table *) calloc(1, sizeof(*t)
+        + ((size_t) 1 << bits) * sizeof(struct size_slot));
+    if (t == NULL) return -ENOSPC;
+    t->bits = bits;
+    for (size_t i = 0; old != NULL && i < (size_t) 1 << old->bits; i++) {
+        struct size_slot *s = &old->slot[i];
+        off_t size = __atomic_load_n(&s->size, __ATOMIC_RELAXED);
+        if (s->ino == 0 || s->ino == SIZE_TOMB) continue;
+        while (! __atomic_compare_exchange_n(&s->size, &size,
+        size | SIZE_MOVED, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+        /* stamps are stored before sizes change, see size_update */
+        size_insert(t, s->ino, size,
+            __atomic_load_n(&s->mtime, __ATOMIC_RELAXED));
+    };
+    __atomic_store_n(&sizes, t, __ATOMIC_SEQ_CST);
+    if (old != NULL) {
+        size_sync();
+        free(old);
+    };
+    return 0;
+};
+
+/* file's size, and its mtime in *mtime (mount time if it has no
+   size) */
+static off_t get_size(fuse_ino_t ino, uint64_t *mtime) {
+    long *r = size_enter();
+    struct size_slot *s = size_find(__atomic_load_n(&sizes,
+        __ATOMIC_SEQ_CST), ino);
+    off_t size = 0;
+
+    *mtime = (uint64_t) start_t << 30;
+    /* a frozen size is the final one */
+    if (s != NULL) {
+        size = __atomic_load_n(&s->size, __ATOMIC_RELAXED) & ~SIZE_MOVED;
+        *mtime = __atomic_load_n(&s->mtime, __ATOMIC_RELAXED);
+    };
+    size_leave(r);
+    return size;
+};
+
+/* sets size and mtime in s, or grows it to size when grow is set;
+   returns 0, or -EAGAIN when s was copied to a new table. mtime is
+   stored first and size always swapped (with itself if it doesn't
+   grow), so a rebuild freezing the size after that sees the mtime,
+   and one freezing it before makes the caller retry */
+static int size_update(struct size_slot *s, off_t size, int grow,
+uint64_t mtime) {
+    off_t cur = __atomic_load_n(&s->size, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&s->mtime, mtime, __ATOMIC_RELAXED);
+    do {
+        if (cur & SIZE_MOVED) return -EAGAIN;
+    } while (! __atomic_compare_exchange_n(&s->size, &cur,
+    (grow && cur >= size) ? cur : size, 1, __ATOMIC_RELEASE,
+    __ATOMIC_RELAXED));
+    return 0;
+};
+
+/* sets file's size, or grows it to size unless it's already longer
+   when grow is set, and its mtime; returns 0 or -ENOSPC */
+static int put_size(fuse_ino_t ino, off_t size, int grow,
+uint64_t mtime) {
+    struct size_slot *s;
+    long *r;
+    int res;
+
+    for (;;) {
+        r = size_enter();
+        s = size_find(__atomic_load_n(&sizes, __ATOMIC_SEQ_CST), ino);
+        res = (s == NULL) ? ((size == 0) ? 0 : -ENOENT)
+            : (size == 0 && ! grow) ? -ENOENT
+            : size_update(s, size, grow, mtime);
+        size_leave(r);
+        if (res != -EAGAIN) break;
+        /* table being rebuilt, wait for it */
+        pthread_mutex_lock(&size_lock);
+        pthread_mutex_unlock(&size_lock);
+    };
+    if (res != -ENOENT) return res;
+
+    res = 0;
+    pthread_mutex_lock(&size_lock);
+    s = size_find(sizes, ino);
+    if (size == 0 && ! grow) {
+        if (s != NULL) {
+            __atomic_store_n(&s->ino, SIZE_TOMB, __ATOMIC_RELEASE);
+            sizes->live--;
+        };
+    } else if (s != NULL) {
+        /* added by someone else meanwhile */
+        size_update(s, size, grow, mtime);
+    } else if ((res = size_reserve()) == 0) {
+        size_insert(sizes, ino, size, mtime);
+    };
+    pthread_mutex_unlock(&size_lock);
+    return res;
+};
+
+static int set_size(fuse_ino_t ino, off_t size) {
+    return put_size(ino, size, 0, stamp_get());
 };
 
-static int nullfs_getattr(const char *path, struct stat *stbuf) {
-    int res = 0;
-    if (! path) return -ENOENT;
+/* extends file to end unless it's already longer */
+static int grow_size(fuse_ino_t ino, off_t end) {
+    return put_size(ino, end, 1, stamp_get());
+};
+
+static void nullfs_stat(fuse_ino_t ino, struct stat *stbuf) {
+    uint64_t mtime;
 
     memset(stbuf, 0, sizeof(struct stat));
-    if (nullfs_isdir(path)) {
+    stbuf->st_ino = ino;
+    stamp_now(&stbuf->st_atim);
+    if (INO_KIND(ino) == INO_DIR) {
         stbuf->st_mode = S_IFDIR | 0777;
         stbuf->st_nlink = 2;
-        stbuf->st_atime = time(NULL);
         stbuf->st_mtime = start_t;
         stbuf->st_ctime = start_t;
     } else {
         stbuf->st_mode = S_IFREG | 0666;
         stbuf->st_nlink = 1;
-        stbuf->st_size = 0;
-        stbuf->st_atime = time(NULL);
-        stbuf->st_mtime = time(NULL);
-        stbuf->st_ctime = time(NULL);
+        stbuf->st_size = get_size(ino, &mtime);
+        stbuf->st_blocks = (stbuf->st_size + 511) / 512;
+        stamp_unpack(mtime, &stbuf->st_mtim);
+        stbuf->st_ctim = stbuf->st_mtim;
     };
+};
 
-    return res;
+static void nullfs_entry(fuse_ino_t ino, struct fuse_entry_param *e) {
+    memset(e, 0, sizeof(*e));
+    e->ino = ino;
+    e->attr_timeout = 1.0;
+    e->entry_timeout = 1.0;
+    nullfs_stat(e->ino, &e->attr);
 };
 
-static int nullfs_readdir(const char *path, void *buf, fuse_fill_dir_t
-filler, off_t offset, struct fuse_file_info *fi) {
-    (void) offset;
-    (void) fi;
+static void nullfs_init(void *userdata, struct fuse_conn_info *conn) {
+    (void) userdata;
 
-    if (! nullfs_isdir(path)) return -ENOENT;
+    ll_init(conn);
+    nullfs_io_init(conn);
+    nullfs_csum_init(conn);
+    nullfs_stats_init();
+    nullfs_delay_init();
+    stamp_init();
+};
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+static void nullfs_lookup(fuse_req_t req, fuse_ino_t parent,
+const char *name) {
+    struct fuse_entry_param e;
+    fuse_ino_t ino;
+    int res, action;
+    STATS_OP(STATS_LOOKUP);
+
+    res = stats_lookup(parent, name, &e);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    };
+    if (res == 0 && parent != FUSE_ROOT_ID) {
+        /* directories made by rules are empty */
+        fuse_reply_err(req, (INO_KIND(parent) == INO_DIR
+            && ! stats_ino(parent)) ? ENOENT : ENOTDIR);
+        return;
+    };
+    if (res == 0) {
+        ino = nullfs_name_ino(name, &action);
+        if (action == RULE_ENOENT) {
+            delay_reply_err(req, ENOENT);
+            return;
+        };
+        nullfs_entry(ino, &e);
+    };
+    delay_reply_entry(req, &e);
+};
 
-    return 0;
+static void nullfs_forget(fuse_req_t req, fuse_ino_t ino,
+uint64_t nlookup) {
+    STATS_OP(STATS_FORGET);
+    (void) ino;
+    (void) nlookup;
+
+    fuse_reply_none(req);
 };
 
-static int nullfs_open(const char *path, struct fuse_file_info *fi) {
+static void nullfs_getattr(fuse_req_t req, fuse_ino_t ino,
+struct fuse_file_info *fi) {
+    struct stat st;
+    STATS_OP(STATS_GETATTR);
     (void) fi;
 
-    if (nullfs_isdir(path)) return -ENOENT;
+    if (! stats_stat(ino, &st)) nullfs_stat(ino, &st);
+    delay_reply_attr(req, &st);
+};
 
-    return 0;
+/* chmod, chown and utimens are no-ops, truncate sets size */
+static void nullfs_setattr(fuse_req_t req, fuse_ino_t ino,
+struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    STATS_OP(STATS_SETATTR);
+
+    if ((to_set & FUSE_SET_ATTR_SIZE) && INO_KIND(ino) != INO_DIR
+    && ! stats_ino(ino)) {
+        if (set_size(ino, attr->st_size) < 0) {
+            delay_reply_err(req, ENOSPC);
+            return;
+        };
+        if (nullfs_csum && attr->st_size == 0) nullfs_csum_forget(ino);
+    };
+    nullfs_getattr(req, ino, fi);
 };
 
-static int nullfs_read(const char *path, char *buf, size_t size,
+static void nullfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 off_t offset, struct fuse_file_info *fi) {
-    (void) buf;
-    (void) size;
-    (void) offset;
+    static const char *names[] = {".", ".."};
+    char buf[64];
+    size_t n = 0;
+    struct stat st;
+    STATS_OP(STATS_READDIR);
     (void) fi;
 
-    if (nullfs_isdir(path)) return -ENOENT;
+    if (ino == STATS_DIR_INO) {
+        stats_readdir(req, size, offset, 0);
+        return;
+    };
+    if (INO_KIND(ino) != INO_DIR || stats_ino(ino)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    };
+    if (size > sizeof(buf)) size = sizeof(buf);
+    nullfs_stat(ino, &st);
+    for (off_t i = offset; i < 2; i++) {
+        size_t e = fuse_add_direntry(req, buf + n, size - n, names[i],
+            &st, i + 1);
+        if (e > size - n) break;
+        n += e;
+    };
 
-    return 0;
+    fuse_reply_buf(req, buf, n);
 };
 
-static int nullfs_write(const char *path, const char *buf, size_t size,
-off_t offset, struct fuse_file_info *fi) {
-    (void) buf;
-    (void) offset;
-    (void) fi;
+static void nullfs_open(fuse_req_t req, fuse_ino_t ino,
+struct fuse_file_info *fi) {
+    STATS_OP(STATS_OPEN);
 
-    if (nullfs_isdir(path)) return -ENOENT;
+    if (ino == STATS_FILE_INO) {
+        stats_open(req, fi);
+        return;
+    };
+    if (INO_KIND(ino) == INO_DIR || ino == STATS_DIR_INO) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    };
+    if (nullfs_csum && (fi->flags & O_TRUNC)) nullfs_csum_forget(ino);
 
-    return (int) size;
+    fuse_reply_open(req, fi);
 };
 
-static int nullfs_create(const char *path, mode_t m,
+static void nullfs_release(fuse_req_t req, fuse_ino_t ino,
 struct fuse_file_info *fi) {
-    (void) path;
-    (void) m;
-    (void) fi;
+    STATS_OP(STATS_RELEASE);
 
-    return 0;
+    if (ino == STATS_FILE_INO) stats_release(req, fi);
+    else fuse_reply_err(req, 0);
 };
 
-static int nullfs_unlink(const char *path) {
-    (void) path;
+static void nullfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+off_t offset, struct fuse_file_info *fi) {
+    STATS_OP(STATS_READ);
 
-    return 0;
+    if (ino == STATS_FILE_INO) {
+        stats_read(req, size, offset, fi);
+        return;
+    };
+    fuse_reply_buf(req, NULL, 0);
 };
 
-static int nullfs_rename(const char *src, const char *dst) {
-    (void) src;
-    (void) dst;
+static void nullfs_write_buf(fuse_req_t req, fuse_ino_t ino,
+struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi) {
+    STATS_OP(STATS_WRITE);
+    ssize_t res = nullfs_csum ? nullfs_csum_write(ino, bufv, offset)
+        : nullfs_discard(bufv);
+    (void) fi;
 
-    return 0;
+    if (res < 0) {
+        fuse_reply_err(req, (int) -res);
+        return;
+    };
+    if (INO_KIND(ino) != INO_DISCARD) {
+        if (res > 0 && grow_size(ino, offset + res) < 0) {
+            delay_reply_err(req, ENOSPC);
+            return;
+        };
+        stats_bytes(STATS_WRITE, res);
+    };
+    nullfs_drop(ino, offset, res);
+    delay_reply_write(req, res);
 };
 
-static int nullfs_truncate(const char *path, off_t o) {
-    (void) path;
-    (void) o;
+static void nullfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+struct fuse_file_info *fi) {
+    STATS_OP(STATS_FSYNC);
+    (void) ino;
+    (void) datasync;
+    (void) fi;
 
-    return 0;
+    delay_reply_err(req, 0);
 };
 
-static int nullfs_chmod(const char *path, mode_t m) {
-    (void) path;
+static void nullfs_create(fuse_req_t req, fuse_ino_t parent,
+const char *name, mode_t m, struct fuse_file_info *fi) {
+    struct fuse_entry_param e;
+    fuse_ino_t ino;
+    int action;
+    STATS_OP(STATS_CREATE);
     (void) m;
 
-    return 0;
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    };
+    ino = nullfs_name_ino(name, &action);
+    if (action == RULE_ENOENT || INO_KIND(ino) == INO_DIR) {
+        fuse_reply_err(req, (action == RULE_ENOENT) ? ENOENT : EISDIR);
+        return;
+    };
+    if (nullfs_csum && (fi->flags & O_TRUNC)) nullfs_csum_forget(ino);
+    nullfs_entry(ino, &e);
+    delay_reply_create(req, &e, fi);
 };
 
-static int nullfs_chown(const char *path, uid_t u, gid_t g) {
-    (void) path;
-    (void) u;
-    (void) g;
+static void nullfs_unlink(fuse_req_t req, fuse_ino_t parent,
+const char *name) {
+    int action;
+    STATS_OP(STATS_UNLINK);
+    fuse_ino_t ino = nullfs_name_ino(name, &action);
+    (void) parent;
 
-    return 0;
+    set_size(ino, 0);
+    if (nullfs_csum) nullfs_csum_forget(ino);
+    delay_reply_err(req, 0);
 };
 
-static int nullfs_utimens(const char *path, const struct timespec ts[2]) {
-    (void) path;
-    (void) ts;
+static void nullfs_rename(fuse_req_t req, fuse_ino_t parent,
+const char *name, fuse_ino_t newparent, const char *newname,
+unsigned int flags) {
+    STATS_OP(STATS_RENAME);
+    int action, newaction;
+    fuse_ino_t ino = nullfs_name_ino(name, &action);
+    fuse_ino_t newino = nullfs_name_ino(newname, &newaction);
+    (void) parent;
+    (void) newparent;
+    (void) flags;
+
+    if (action == RULE_ENOENT || newaction == RULE_ENOENT) {
+        delay_reply_err(req, ENOENT);
+        return;
+    };
+    /* size, mtime and checksum move with the name */
+    if (ino != newino) {
+        uint64_t mtime;
+        off_t size = get_size(ino, &mtime);
+        if (put_size(newino, size, 0, mtime) < 0) {
+            delay_reply_err(req, ENOSPC);
+            return;
+        };
+        set_size(ino, 0);
+        if (nullfs_csum) nullfs_csum_move(ino, newino);
+    };
+    delay_reply_err(req, 0);
+};
 
-    return 0;
+/* user.nullfs.crc32c of files with -o checksum */
+static void nullfs_getxattr(fuse_req_t req, fuse_ino_t ino,
+const char *name, size_t size) {
+    STATS_OP(STATS_GETXATTR);
+
+    if (INO_KIND(ino) == INO_DIR || stats_ino(ino))
+        fuse_reply_err(req, ENODATA);
+    else
+        nullfs_csum_getxattr(req, ino, name, size);
+};
+
+static void nullfs_listxattr(fuse_req_t req, fuse_ino_t ino,
+size_t size) {
+    STATS_OP(STATS_LISTXATTR);
+
+    if (INO_KIND(ino) == INO_DIR || stats_ino(ino))
+        fuse_reply_xattr(req, 0);
+    else
+        nullfs_csum_listxattr(req, size);
 };
 
-static struct fuse_operations nullfs_oper = {
+static struct fuse_lowlevel_ops nullfs_oper = {
+    .init       = nullfs_init,
+    .lookup     = nullfs_lookup,
+    .forget     = nullfs_forget,
     .getattr    = nullfs_getattr,
+    .setattr    = nullfs_setattr,
     .readdir    = nullfs_readdir,
     .open       = nullfs_open,
+    .release    = nullfs_release,
     .read       = nullfs_read,
-    .write      = nullfs_write,
+    .write_buf  = nullfs_write_buf,
+    .fsync      = nullfs_fsync,
     .create     = nullfs_create,
     .unlink     = nullfs_unlink,
     .rmdir      = nullfs_unlink,
-    .truncate   = nullfs_truncate,
     .rename     = nullfs_rename,
-    .chmod      = nullfs_chmod,
-    .chown      = nullfs_chown,
-    .utimens    = nullfs_utimens,
+    .getxattr   = nullfs_getxattr,
+    .listxattr  = nullfs_listxattr,
 };
 
+#ifndef NULLFS_NO_MAIN
 int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
     start_t = time(NULL);
-    return fuse_main(argc, argv, &nullfs_oper, NULL);
+    if (fuse_opt_parse(&args, &conf, nul1fs_opts, NULL) == -1
+    || fuse_opt_parse(&args, &delay_conf, delay_opts, NULL) == -1
+    || fuse_opt_parse(&args, &nullfs_writeback, nullfs_io_opts, NULL)
+    == -1 || fuse_opt_parse(&args, NULL, rules_opts, rules_opt_proc)
+    == -1 || fuse_opt_parse(&args, &nullfs_csum, nullfs_csum_opts, NULL)
+    == -1 || rules_compile())
+        return 1;
+    return ll_main(&args, &nullfs_oper, sizeof(nullfs_oper));
 };
+#endif
 
 /* vi:set sw=4 et tw=72: */
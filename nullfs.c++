@@ -7,204 +7,1703 @@
 */
 
 #define _FILE_OFFSET_BITS 64
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+#define FUSE_USE_VERSION 312
+#include <fuse3/fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "ll_main.h"
+#include "nullfs_io.h"
+#include "nullfs_synth.h"
+#include "nullfs_stats.h"
+#include "nullfs_delay.h"
+#include "nullfs_rules.h"
+#include "nullfs_csum.h"
 
-#include <set>
-#include <string>
-using std::string;
-using std::set;
-set<string> dirs;       /* global register of directories */
-set<string> files;      /* global register of files */
+/* Global directory tree. Every node stores its own path component
+   once and points to its parent; directories keep a list of their
+   children, so readdir costs O(children). Nodes are found by
+   (parent, name) in a hash split into lock-striped shards, so fuse
+   worker threads resolving different paths don't serialize on one
+   lock. Children lists are guarded by striped directory locks.
+   Node's address is its inode number, the kernel holds a reference
+   for every lookup it hasn't forgotten yet.
 
-static int strendswith(const char *str, const char *sfx) {
-    size_t sfx_len = strlen(sfx);
-    size_t str_len = strlen(str);
-    if (str_len < sfx_len) return 0;
-    return (strncmp(str + (str_len - sfx_len), sfx, sfx_len) == 0);
+   Files remember their size: end of the furthest write, or what
+   truncate set. Reads return EOF, but with -o zero_fill files read
+   back as zeros up to their size, like sparse files with no data at
+   all. With -o synth=random or synth=pattern they read back as
+   content generated from the path they were created at (mixed with
+   -o synth_seed=N) and offset instead, and start -o synth_size=N
+   bytes long.
+
+   Every node keeps the state of path rules' DFA at its own path, so
+   a lookup classifies a name by stepping over it alone. Paths that
+   rules say always exist are created when looked up; with no rules
+   given that's "foo" in any directory.
+
+   With -o backing=DIR, files rules mark "pass" keep their data in
+   DIR under the same path: the kernel reads and writes them there
+   itself when it can pass file I/O through, otherwise write_buf
+   and read copy it. Their nodes stay in the tree like any other,
+   backing directories are made as files in them are opened.
+
+   With -o counters every node also keeps bytes and write requests
+   written to files in its subtree and the number of those files,
+   so getxattr("user.nullfs.bytes") on any directory answers for its
+   whole subtree. Writes and creates only add to the file's own
+   pending counts, and queue the file once until they are folded
+   into the sums along its path, which getxattr does first. */
+enum nullfs_type { NULLFS_NONE = 0, NULLFS_DIR, NULLFS_FILE };
+
+#define SHARD_BITS 6
+#define N_SHARDS (1 << SHARD_BITS)
+
+/* subtree sums, kept with relaxed atomics */
+struct counts {
+    uint64_t bytes;     /* bytes written */
+    uint64_t writes;    /* write requests */
+    uint64_t files;     /* regular files */
 };
 
-static int nullfs_isdir(const char *path) {
-    set<string>::const_iterator pos = dirs.find(string(path));
-    if (pos != dirs.end()) return 1;
-    return (strendswith(path, "/") || strendswith(path, "/..")
-        || strendswith(path, "/.") || (strcmp(path, "..") == 0)
-        || (strcmp(path, ".") == 0));
+struct node {
+    node *parent;       /* containing directory, NULL once removed */
+    node *hnext;        /* next node in index bucket */
+    node *prev, *next;  /* siblings in parent's list of children */
+    node *children;     /* first child (directories only) */
+    size_t hash;        /* hash of (parent, name) */
+    off_t size;         /* logical file size */
+    int ref;            /* references, the tree link holds one */
+    unsigned char type;
+    unsigned char namecap;  /* size of name buffer without '\0' */
+    uint16_t rstate;    /* rules state at node's path */
+    uint64_t seed;      /* hash of the path it was created at */
+    int dirty;          /* on dirty list, with counters */
+    counts sum;         /* over the node and its subtree */
+    counts delta;       /* not yet folded into sums */
+    node *dnext;        /* next on dirty list */
+    char *name;         /* path component, points to inl unless
+                           renamed to a longer name */
+    char inl[];
 };
 
-static int nullfs_isfile(const char *path) {
-    if (strendswith(path, "/foo") || (strcmp(path, "foo") == 0))
-        return 1;
-    set<string>::const_iterator pos = files.find(string(path));
-    return (pos != files.end());
+struct stripe {
+    pthread_rwlock_t lock;
+    stripe() { pthread_rwlock_init(&lock, NULL); };
+} __attribute__((aligned(64)));
+
+struct shard : stripe {
+    node **tab;         /* hash buckets */
+    size_t mask;        /* number of buckets - 1 */
+    size_t n;           /* number of nodes */
+};
+
+static shard shards[N_SHARDS];
+static stripe dir_locks[N_SHARDS];
+/* held by operations that lock more than one directory (rename,
+   rmdir), so they can't deadlock with each other */
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+/* odd while move_node() changes a name or parent, under rename_lock,
+   so node_path() can tell its walk up saw a rename go by */
+static unsigned rename_seq = 0;
+/* with -o counters, held while sums are changed: pending counts
+   folded in, or a subtree's sums moved between ancestors by unlink
+   and rename, so a fold walks the path the node is on. taken after
+   directory locks; writes don't take it */
+static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+/* nodes with pending counts, each holding a reference */
+static node *dirty_nodes = NULL;
+
+/* mount options */
+struct nullfs_config {
+    int zero_fill;      /* files read back as zeros up to their size */
+    int synth;          /* synth_mode files read back as */
+    long long synth_size;   /* size of new files in synth mode */
+    unsigned long long synth_seed;  /* mixed into every path hash */
+    char *backing;      /* directory "pass" files are kept in */
+    int counters;       /* subtree byte, write and file counts */
+};
+
+static nullfs_config conf;
+
+#define NULLFS_OPT(t, p) { t, offsetof(struct nullfs_config, p), 1 }
+static const struct fuse_opt nullfs_opts[] = {
+    NULLFS_OPT("zero_fill", zero_fill),
+    { "synth=random", offsetof(struct nullfs_config, synth),
+        SYNTH_RANDOM },
+    { "synth=pattern", offsetof(struct nullfs_config, synth),
+        SYNTH_PATTERN },
+    NULLFS_OPT("synth_size=%lli", synth_size),
+    NULLFS_OPT("synth_seed=%llu", synth_seed),
+    NULLFS_OPT("backing=%s", backing),
+    NULLFS_OPT("counters", counters),
+    FUSE_OPT_END
+};
+
+static size_t name_hash(const node *parent, const char *name,
+size_t len) {
+    uint64_t h = (uintptr_t) parent * 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) name[i]) * 0x100000001b3ULL;
+    return (size_t) (h ^ (h >> 29));
+};
+
+/* FNV-1a of name in dir's path, which synth content is generated
+   from, so a file made at the same path reads the same in every
+   mount. kept over renames, like real content would be */
+static uint64_t path_seed(const node *dir, const char *name,
+size_t len) {
+    uint64_t h = (dir->seed ^ '/') * 0x100000001b3ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) name[i]) * 0x100000001b3ULL;
+    return h;
+};
+
+static shard &shard_of(size_t h) {
+    return shards[h & (N_SHARDS - 1)];
+};
+
+static pthread_rwlock_t *dir_lock(const node *dir) {
+    uintptr_t p = (uintptr_t) dir;
+    return &dir_locks[(p ^ (p >> 12)) >> 6 & (N_SHARDS - 1)].lock;
+};
+
+/* directory locks taken for writing by rename/rmdir. they all hold
+   rename_lock, and everybody else takes one directory lock at most,
+   so these can be taken in any order */
+struct lockset {
+    pthread_rwlock_t *l[4];
+    int n;
+    lockset() : n(0) {};
+    void add(const node *dir) {
+        pthread_rwlock_t *p = dir_lock(dir);
+        for (int i = 0; i < n; i++) if (l[i] == p) return;
+        pthread_rwlock_wrlock(p);
+        l[n++] = p;
+    };
+    void release(void) {
+        while (n) pthread_rwlock_unlock(l[--n]);
+    };
+};
+
+static node *new_node(const char *name, size_t len, int type) {
+    node *n = (node *) malloc(sizeof(node) + len + 1);
+    if (n == NULL) return NULL;
+    memset(n, 0, sizeof(node));
+    n->ref = 1;
+    n->type = type;
+    n->namecap = len;
+    if (type == NULLFS_FILE) n->size = conf.synth_size;
+    n->name = n->inl;
+    memcpy(n->name, name, len);
+    n->name[len] = '\0';
+    return n;
+};
+
+static void get_node(node *n) {
+    __atomic_add_fetch(&n->ref, 1, __ATOMIC_RELAXED);
+};
+
+static void put_node(node *n, int k = 1) {
+    if (__atomic_sub_fetch(&n->ref, k, __ATOMIC_ACQ_REL) == 0) {
+        /* its address may come back as another inode */
+        if (nullfs_csum) nullfs_csum_forget((fuse_ino_t) (uintptr_t) n);
+        if (n->name != n->inl) free(n->name);
+        free(n);
+    };
+};
+
+static node *new_root(void) {
+    node *n = new_node("", 0, NULLFS_DIR);
+    n->parent = n;
+    return n;
+};
+
+static node *root = new_root();
+
+/* /.nullfs isn't linked into the tree and is found by name. its
+   only child is the stats file. both are set up by init, can't be
+   changed and no rules apply to them */
+static node *stats_dir = NULL;
+static node *stats_file = NULL;
+
+static int stats_name(const node *dir, const char *name) {
+    return stats_dir != NULL && (dir == stats_dir
+        || (dir == root && strcmp(name, STATS_DIR_NAME) == 0));
+};
+
+static fuse_ino_t node_ino(const node *n) {
+    return (n == root) ? FUSE_ROOT_ID : (fuse_ino_t) (uintptr_t) n;
+};
+
+static node *ino_node(fuse_ino_t ino) {
+    return (ino == FUSE_ROOT_ID) ? root : (node *) (uintptr_t) ino;
+};
+
+/* rules state of name in dir */
+static unsigned child_rstate(const node *dir, const char *name,
+size_t len) {
+    return rules_child(__atomic_load_n(&dir->rstate, __ATOMIC_RELAXED),
+        name, len);
+};
+
+static int node_action(const node *n) {
+    return rules_action(__atomic_load_n(&n->rstate, __ATOMIC_RELAXED));
+};
+
+/* finds child of dir by name; caller holds shard lock */
+static node *shard_find(const shard &s, size_t h, const node *dir,
+const char *name, size_t len) {
+    if (s.tab == NULL) return NULL;
+    for (node *n = s.tab[(h >> SHARD_BITS) & s.mask]; n; n = n->hnext)
+        if (n->hash == h && n->parent == dir
+        && strncmp(n->name, name, len) == 0 && n->name[len] == '\0')
+            return n;
+    return NULL;
+};
+
+/* adds node to index, doubling the table when it gets full; if the
+   table can't grow, buckets just get longer. caller holds lock */
+static void shard_add(shard &s, node *n) {
+    if (s.n >= s.mask) {
+        size_t mask = s.tab ? s.mask * 2 + 1 : 15;
+        node **tab = (node **) calloc(mask + 1, sizeof(node *));
+        if (tab != NULL) {
+            for (size_t i = 0; s.tab && i <= s.mask; i++) {
+                node *c, *c_next;
+                for (c = s.tab[i]; c; c = c_next) {
+                    size_t b = (c->hash >> SHARD_BITS) & mask;
+                    c_next = c->hnext;
+                    c->hnext = tab[b];
+                    tab[b] = c;
+                };
+            };
+            free(s.tab);
+            s.tab = tab;
+            s.mask = mask;
+        };
+    };
+    node **b = &s.tab[(n->hash >> SHARD_BITS) & s.mask];
+    n->hnext = *b;
+    *b = n;
+    s.n++;
+};
+
+/* removes node from index; caller holds lock */
+static void shard_del(shard &s, node *n) {
+    node **p = &s.tab[(n->hash >> SHARD_BITS) & s.mask];
+    while (*p != n) p = &(*p)->hnext;
+    *p = n->hnext;
+    s.n--;
+};
+
+/* links n into dir's children; n->parent must be already set (before
+   n became visible in index). caller holds dir_lock(dir) */
+static void link_child(node *dir, node *n) {
+    n->prev = NULL;
+    n->next = dir->children;
+    if (dir->children) dir->children->prev = n;
+    dir->children = n;
+};
+
+/* unlinks n from its parent's children; caller holds dir_lock */
+static void unlink_child(node *n) {
+    if (n->prev) n->prev->next = n->next;
+    else n->parent->children = n->next;
+    if (n->next) n->next->prev = n->prev;
+    n->parent = NULL;
+};
+
+/* looks up child of dir, stores its type in *type. if ref is set,
+   child is returned with a reference held, otherwise returned
+   pointer is only good while dir_lock(dir) is held */
+static node *find_child(const node *dir, const char *name, size_t len,
+int *type, int ref) {
+    size_t h = name_hash(dir, name, len);
+    shard &s = shard_of(h);
+    pthread_rwlock_rdlock(&s.lock);
+    node *n = shard_find(s, h, dir, name, len);
+    if (n != NULL) {
+        *type = n->type;
+        if (ref) get_node(n);
+    };
+    pthread_rwlock_unlock(&s.lock);
+    return n;
+};
+
+/* readdir cursors of open directory handles sit in children lists
+   as nodes of type NULLFS_NONE; directory is empty when it has no
+   other children */
+static int dir_empty(const node *dir) {
+    for (const node *n = dir->children; n; n = n->next)
+        if (n->type != NULLFS_NONE) return 0;
+    return 1;
+};
+
+static void lock_counts(void) {
+    if (conf.counters) pthread_mutex_lock(&count_lock);
+};
+
+static void unlock_counts(void) {
+    if (conf.counters) pthread_mutex_unlock(&count_lock);
+};
+
+/* adds bytes, writes and files to sums of n and its ancestors up
+   to the top of its tree (root, or n itself once removed); caller
+   holds count_lock */
+static void count_path(node *n, uint64_t bytes, uint64_t writes,
+uint64_t files) {
+    for (;; n = n->parent) {
+        n->sum.bytes += bytes;
+        n->sum.writes += writes;
+        n->sum.files += files;
+        if (n->parent == n || n->parent == NULL) break;
+    };
+};
+
+/* adds (sign 1) or takes away (sign -1) sums of n to dir and its
+   ancestors; caller holds count_lock. counts still pending on nodes
+   under n never reached the ancestors, and are folded along the
+   path n is on when they are */
+static void count_subtree(node *dir, const node *n, int sign) {
+    count_path(dir, (uint64_t) sign * n->sum.bytes,
+        (uint64_t) sign * n->sum.writes,
+        (uint64_t) sign * n->sum.files);
+};
+
+/* queues n after its pending counts were added to, unless it's
+   queued already. either a fold clears dirty after this sees it
+   set and then takes the counts, or this sees it clear */
+static void count_dirty(node *n) {
+    if (__atomic_load_n(&n->dirty, __ATOMIC_SEQ_CST)
+    || __atomic_exchange_n(&n->dirty, 1, __ATOMIC_SEQ_CST))
+        return;
+    get_node(n);
+    n->dnext = __atomic_load_n(&dirty_nodes, __ATOMIC_RELAXED);
+    while (! __atomic_compare_exchange_n(&dirty_nodes, &n->dnext, n, 1,
+    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+};
+
+static void count_write(node *n, size_t bytes) {
+    if (! conf.counters) return;
+    __atomic_add_fetch(&n->delta.bytes, bytes, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&n->delta.writes, 1, __ATOMIC_SEQ_CST);
+    count_dirty(n);
+};
+
+/* adds pending counts of all queued nodes to their paths; caller
+   holds count_lock */
+static void count_fold(void) {
+    node *n = __atomic_exchange_n(&dirty_nodes, (node *) NULL,
+        __ATOMIC_ACQUIRE);
+
+    while (n != NULL) {
+        node *next = n->dnext;
+        __atomic_store_n(&n->dirty, 0, __ATOMIC_SEQ_CST);
+        count_path(n,
+            __atomic_exchange_n(&n->delta.bytes, 0, __ATOMIC_SEQ_CST),
+            __atomic_exchange_n(&n->delta.writes, 0, __ATOMIC_SEQ_CST),
+            __atomic_exchange_n(&n->delta.files, 0, __ATOMIC_SEQ_CST));
+        put_node(n);
+        n = next;
+    };
 };
 
-static int nullfs_getattr(const char *path, struct stat *stbuf) {
+/* creates node of type in dir unless something is already named
+   so; returns type of the existing node, NULLFS_NONE on success or
+   -errno. unless error is returned, *np is the node with reference
+   held */
+static int add_node(node *dir, const char *name, int type, node **np) {
+    size_t len = strlen(name);
+    unsigned rst;
+    node *n;
+    int res;
+
+    if (dir->type != NULLFS_DIR) return -ENOTDIR;
+    if (len > 255) return -ENAMETOOLONG;
+    if (dir == stats_dir) return -EPERM;
+    if (stats_name(dir, name)) {
+        get_node(stats_dir);
+        *np = stats_dir;
+        return NULLFS_DIR;
+    };
+    n = new_node(name, len, type);
+    if (n == NULL) return -ENOMEM;
+
+    pthread_rwlock_wrlock(dir_lock(dir));
+    /* dir's state can only change under its lock, see move_node */
+    rst = child_rstate(dir, name, len);
+    if (dir->parent == NULL || rules_action(rst) == RULE_ENOENT) {
+        res = -ENOENT;  /* removed or ruled out */
+    } else if (rules_action(rst) == RULE_DIR && type != NULLFS_DIR) {
+        res = -EISDIR;
+    } else if (rules_action(rst) == RULE_FILE && type == NULLFS_DIR) {
+        res = -EEXIST;
+    } else {
+        n->rstate = rst;
+        n->seed = path_seed(dir, name, len);
+        n->hash = name_hash(dir, name, len);
+        n->parent = dir;
+        shard &s = shard_of(n->hash);
+        pthread_rwlock_wrlock(&s.lock);
+        node *o = shard_find(s, n->hash, dir, name, len);
+        if (o != NULL) {
+            res = o->type;
+            get_node(o);
+            *np = o;
+        } else {
+            shard_add(s, n);
+            get_node(n);
+            *np = n;
+            res = NULLFS_NONE;
+        };
+        pthread_rwlock_unlock(&s.lock);
+        if (o == NULL) {
+            link_child(dir, n);
+            if (type == NULLFS_FILE && conf.counters) {
+                __atomic_store_n(&n->delta.files, 1, __ATOMIC_SEQ_CST);
+                count_dirty(n);
+            };
+        };
+    };
+    pthread_rwlock_unlock(dir_lock(dir));
+
+    if (res != NULLFS_NONE) free(n);
+    return res;
+};
+
+/* removes n from index and its parent's children; caller holds
+   parent's dir_lock and, for directories, n's own dir_lock and made
+   sure n is empty */
+static void remove_child(node *n) {
+    shard &s = shard_of(n->hash);
+    pthread_rwlock_wrlock(&s.lock);
+    shard_del(s, n);
+    pthread_rwlock_unlock(&s.lock);
+    unlink_child(n);
+};
+
+/* removes node of given type named name from dir; returns 0 or
+   -errno */
+static int del_node(node *dir, const char *name, int type) {
+    size_t len = strlen(name);
+    node *n = NULL;
+    int t = NULLFS_NONE;
     int res = 0;
 
-    memset(stbuf, 0, sizeof(struct stat));
-    if (nullfs_isdir(path)) {
-        stbuf->st_mode = S_IFDIR | 0777;
-        stbuf->st_nlink = 3;
-    } else if (nullfs_isfile(path)) {
-        stbuf->st_mode = S_IFREG | 0666;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = 0;
+    if (stats_name(dir, name)) return -EPERM;
+    if (type == NULLFS_DIR) {
+        lockset ls;
+        pthread_mutex_lock(&rename_lock);
+        ls.add(dir);
+        if (dir->parent == NULL
+        || (n = find_child(dir, name, len, &t, 0)) == NULL) {
+            res = -ENOENT;
+        } else if (t != NULLFS_DIR) {
+            res = -ENOTDIR;
+        } else {
+            ls.add(n);
+            if (! dir_empty(n)) res = -ENOTEMPTY;
+            else remove_child(n);
+        };
+        ls.release();
+        pthread_mutex_unlock(&rename_lock);
     } else {
+        pthread_rwlock_wrlock(dir_lock(dir));
+        if (dir->parent == NULL
+        || (n = find_child(dir, name, len, &t, 0)) == NULL) {
+            res = -ENOENT;
+        } else if (t != NULLFS_FILE) {
+            res = -EISDIR;
+        } else {
+            lock_counts();
+            count_subtree(dir, n, -1);
+            remove_child(n);
+            unlock_counts();
+        };
+        pthread_rwlock_unlock(dir_lock(dir));
+    };
+
+    if (res == 0) put_node(n);
+    return res;
+};
+
+/* sets rules states in the subtree of moved directory s. nodes
+   whose state didn't change have their subtrees unchanged as well.
+   caller holds rename_lock, so directories here can't move away or
+   be removed; each one's lock is taken alone while its children
+   are updated, after its own state was, so add_node() in there
+   sees either the old children list or the new state */
+static void restate_subtree(node *s) {
+    node **stack = NULL;
+    size_t n = 0, cap = 0;
+
+    for (node *dir = s; dir != NULL; dir = n ? stack[--n] : NULL) {
+        unsigned st = __atomic_load_n(&dir->rstate, __ATOMIC_RELAXED);
+        pthread_rwlock_wrlock(dir_lock(dir));
+        for (node *c = dir->children; c; c = c->next) {
+            unsigned cst;
+            if (c->type == NULLFS_NONE) continue;
+            cst = rules_child(st, c->name, strlen(c->name));
+            if (cst == c->rstate) continue;
+            __atomic_store_n(&c->rstate, cst, __ATOMIC_RELAXED);
+            if (c->type != NULLFS_DIR) continue;
+            if (n == cap) {
+                node **p = (node **) realloc(stack,
+                    (cap ? cap * 2 : 64) * sizeof(node *));
+                if (p == NULL) continue;    /* left stale */
+                stack = p;
+                cap = cap ? cap * 2 : 64;
+            };
+            stack[n++] = c;
+        };
+        pthread_rwlock_unlock(dir_lock(dir));
+    };
+    free(stack);
+};
+
+/* moves node named sname in sdir to dname in ddir, replacing what
+   was there unless RENAME_NOREPLACE is in flags; returns 0 or
+   -errno */
+static int move_node(node *sdir, const char *sname, node *ddir,
+const char *dname, unsigned int flags) {
+    size_t slen = strlen(sname), dlen = strlen(dname);
+    lockset ls;
+    node *s = NULL, *d = NULL;
+    int d_removed = 0, restate = 0;
+    char *newname = NULL;
+    int st = NULLFS_NONE, dt = NULLFS_NONE;
+    unsigned rst;
+    int res = 0;
+
+    if (flags & ~RENAME_NOREPLACE) return -EINVAL;
+    if (stats_name(sdir, sname) || stats_name(ddir, dname))
+        return -EPERM;
+
+    pthread_mutex_lock(&rename_lock);
+    ls.add(sdir);
+    ls.add(ddir);
+
+    if (sdir->parent == NULL || ddir->parent == NULL
+    || (s = find_child(sdir, sname, slen, &st, 0)) == NULL) {
         res = -ENOENT;
+        goto MOVE_NODE_OUT;
+    };
+    d = find_child(ddir, dname, dlen, &dt, 0);
+    if (d == s) goto MOVE_NODE_OUT;
+    if (d != NULL && (flags & RENAME_NOREPLACE)) {
+        res = -EEXIST;
+        goto MOVE_NODE_OUT;
+    };
+    rst = child_rstate(ddir, dname, dlen);
+    if (rules_action(rst) == RULE_ENOENT) res = -ENOENT;
+    else if (rules_action(rst) == RULE_DIR && st != NULLFS_DIR)
+        res = -EISDIR;
+    else if (rules_action(rst) == RULE_FILE && st == NULLFS_DIR)
+        res = -ENOTDIR;
+    if (res) goto MOVE_NODE_OUT;
+    if (st == NULLFS_DIR) {
+        ls.add(s);
+        /* can't move directory into its own subtree */
+        for (node *p = ddir; p != root; p = p->parent) {
+            if (p == s) {
+                res = -EINVAL;
+                goto MOVE_NODE_OUT;
+            };
+        };
+    };
+    if (d != NULL) {
+        if (dt == NULLFS_DIR && st != NULLFS_DIR) res = -EISDIR;
+        else if (dt != NULLFS_DIR && st == NULLFS_DIR) res = -ENOTDIR;
+        if (res) goto MOVE_NODE_OUT;
+        if (dt == NULLFS_DIR) {
+            ls.add(d);
+            if (! dir_empty(d)) {
+                res = -ENOTEMPTY;
+                goto MOVE_NODE_OUT;
+            };
+        };
     };
+    if (dlen > s->namecap) {
+        if (dlen > 255 || (newname = (char *) malloc(dlen + 1)) == NULL) {
+            res = (dlen > 255) ? -ENAMETOOLONG : -ENOMEM;
+            goto MOVE_NODE_OUT;
+        };
+    };
+
+    lock_counts();
+    if (d != NULL) {
+        count_subtree(ddir, d, -1);
+        remove_child(d);
+        d_removed = 1;
+    };
+    count_subtree(sdir, s, -1);
+    remove_child(s);
+    __atomic_store_n(&rename_seq, rename_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (newname != NULL) {
+        if (s->name != s->inl) free(s->name);
+        s->name = newname;
+        s->namecap = dlen;
+    };
+    memcpy(s->name, dname, dlen);
+    s->name[dlen] = '\0';
+    s->hash = name_hash(ddir, dname, dlen);
+    s->parent = ddir;
+    restate = (st == NULLFS_DIR && rst != s->rstate);
+    __atomic_store_n(&s->rstate, rst, __ATOMIC_RELAXED);
+    {
+        shard &h = shard_of(s->hash);
+        pthread_rwlock_wrlock(&h.lock);
+        shard_add(h, s);
+        pthread_rwlock_unlock(&h.lock);
+    };
+    link_child(ddir, s);
+    __atomic_store_n(&rename_seq, rename_seq + 1, __ATOMIC_RELEASE);
+    count_subtree(ddir, s, 1);
+    unlock_counts();
 
+MOVE_NODE_OUT:
+    ls.release();
+    if (restate) restate_subtree(s);
+    pthread_mutex_unlock(&rename_lock);
+
+    if (d_removed) put_node(d);
     return res;
 };
 
-static int nullfs_readdir(const char *path, void *buf, fuse_fill_dir_t
-filler, off_t offset, struct fuse_file_info *fi) {
-    (void) offset;
-    (void) fi;
+static int backing_fd = -1;
+static int backing_kernel = 0;  /* kernel passes file I/O through */
 
-    /*if (! nullfs_isdir(path)) return -ENOENT;*/
+/* open file of a "pass" node. backing_id is kernel's handle of fd
+   when it does the I/O, 0 when it comes through the daemon */
+struct pass_file {
+    int fd;
+    int backing_id;
+};
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    filler(buf, "foo", NULL, 0);
+static int pass_node(const node *n) {
+    return backing_fd >= 0 && n->type == NULLFS_FILE
+        && node_action(n) == RULE_PASS;
+};
 
+/* puts s in front of what's in buf from *pos */
+static int path_put(char *buf, size_t *pos, const char *s, size_t len) {
+    if (len + 1 > *pos) return -ENAMETOOLONG;
+    *pos -= len;
+    memcpy(buf + *pos, s, len);
     return 0;
 };
 
-static int nullfs_open(const char *path, struct fuse_file_info *fi) {
-    (void) fi;
+/* builds path of name in dir (dir itself when name is NULL) from
+   the end of buf, setting *pos to where it starts. each name is read
+   under the lock of the directory it's in, which is referenced
+   before that lock is dropped, so it can't go away on the walk up */
+static int path_walk(const node *dir, const char *name, char *buf,
+size_t size, size_t *pos) {
+    node *held = NULL;
+    int slash = 0, res = 0;
+
+    *pos = size - 1;
+    buf[*pos] = '\0';
+    if (name != NULL) {
+        res = path_put(buf, pos, name, strlen(name));
+        slash = 1;
+    };
+    while (res == 0 && dir != root) {
+        node *p = __atomic_load_n(&dir->parent, __ATOMIC_RELAXED);
+        if (p == NULL) {
+            res = -ENOENT;  /* removed */
+            break;
+        };
+        pthread_rwlock_rdlock(dir_lock(p));
+        if (dir->parent == p) {
+            if (slash) res = path_put(buf, pos, "/", 1);
+            if (res == 0) res = path_put(buf, pos, dir->name,
+                strlen(dir->name));
+            slash = 1;
+            get_node(p);
+            if (held != NULL) put_node(held);
+            held = p;
+            dir = p;
+        };
+        pthread_rwlock_unlock(dir_lock(p));
+    };
+    if (held != NULL) put_node(held);
+    return res;
+};
+
+/* path of name in dir relative to the backing directory, or of dir
+   itself when name is NULL; returns 0 or -errno. walked again when
+   a rename went by, so it is one the tree had at some point */
+static int node_path(const node *dir, const char *name, char *buf,
+size_t size) {
+    size_t pos;
+    int res;
 
-    if (! nullfs_isfile(path)) return -ENOENT;
+    for (;;) {
+        unsigned seq = __atomic_load_n(&rename_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            /* wait for the rename rather than spin */
+            pthread_mutex_lock(&rename_lock);
+            pthread_mutex_unlock(&rename_lock);
+            continue;
+        };
+        res = path_walk(dir, name, buf, size, &pos);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&rename_seq, __ATOMIC_RELAXED) == seq) break;
+    };
+    if (res == 0) memmove(buf, buf + pos, size - pos);
+    return res;
+};
 
-    return 0;
+/* makes missing directories of path under the backing directory */
+static void backing_mkdirs(char *path) {
+    for (char *s = strchr(path, '/'); s; s = strchr(s + 1, '/')) {
+        *s = '\0';
+        mkdirat(backing_fd, path, 0777);
+        *s = '/';
+    };
 };
 
-static int nullfs_read(const char *path, char *buf, size_t size,
-off_t offset, struct fuse_file_info *fi) {
-    (void) buf;
-    (void) size;
-    (void) offset;
-    (void) fi;
+/* opens backing file of n; returns fd or -errno */
+static int backing_open(const node *n, int flags) {
+    char path[PATH_MAX];
+    int fd, res = node_path(n, NULL, path, sizeof(path));
+
+    if (res < 0) return res;
+    fd = openat(backing_fd, path, flags | O_CLOEXEC, 0666);
+    if (fd < 0 && errno == ENOENT && (flags & O_CREAT)) {
+        backing_mkdirs(path);
+        fd = openat(backing_fd, path, flags | O_CLOEXEC, 0666);
+    };
+    return (fd < 0) ? -errno : fd;
+};
+
+/* takes size of pass node from its backing file */
+static void pass_size(node *n, int fd) {
+    char path[PATH_MAX];
+    struct stat st;
 
-    if (! nullfs_isfile(path)) return -ENOENT;
+    if (fd >= 0) {
+        if (fstat(fd, &st)) return;
+    } else if (node_path(n, NULL, path, sizeof(path))
+    || fstatat(backing_fd, path, &st, 0)) {
+        return;
+    };
+    __atomic_store_n(&n->size, st.st_size, __ATOMIC_RELAXED);
+};
+
+/* opens backing file of n for fi, handing it to the kernel when it
+   can take it; returns 0 or -errno */
+static int pass_open(fuse_req_t req, node *n, struct fuse_file_info *fi,
+int flags) {
+    pass_file *pf = (pass_file *) calloc(1, sizeof(pass_file));
 
+    if (pf == NULL) return -ENOMEM;
+    pf->fd = backing_open(n, flags);
+    if (pf->fd < 0) {
+        int res = pf->fd;
+        free(pf);
+        return res;
+    };
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (backing_kernel) {
+        /* e.g. without CAP_SYS_ADMIN it fails, and we copy */
+        pf->backing_id = fuse_passthrough_open(req, pf->fd);
+        if (pf->backing_id > 0) fi->backing_id = pf->backing_id;
+        else pf->backing_id = 0;
+    };
+#else
+    (void) req;
+#endif
+    pass_size(n, pf->fd);
+    fi->fh = (uintptr_t) pf;
     return 0;
 };
 
-static int nullfs_write(const char *path, const char *buf, size_t size,
+static void pass_release(fuse_req_t req, node *n,
+struct fuse_file_info *fi) {
+    pass_file *pf = (pass_file *) (uintptr_t) fi->fh;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (pf->backing_id) fuse_passthrough_close(req, pf->backing_id);
+#else
+    (void) req;
+#endif
+    pass_size(n, pf->fd);
+    close(pf->fd);
+    free(pf);
+};
+
+/* pass file open in fi, or NULL. other regular files don't get a
+   file handle, so it is set for pass files only */
+static pass_file *pass_fi(const node *n, struct fuse_file_info *fi) {
+    if (fi == NULL || fi->fh == 0 || n == stats_file
+    || n->type != NULLFS_FILE)
+        return NULL;
+    return (pass_file *) (uintptr_t) fi->fh;
+};
+
+/* name in dir is a pass path missing from the tree: adds what the
+   backing directory has there, so pass files outlive the mount */
+static node *pass_lookup(node *dir, const char *name) {
+    char path[PATH_MAX];
+    struct stat st;
+    node *n;
+
+    if (node_path(dir, name, path, sizeof(path))
+    || fstatat(backing_fd, path, &st, 0)
+    || (! S_ISREG(st.st_mode) && ! S_ISDIR(st.st_mode))
+    || add_node(dir, name, S_ISDIR(st.st_mode) ? NULLFS_DIR
+    : NULLFS_FILE, &n) < 0)
+        return NULL;
+    if (n->type == NULLFS_FILE)
+        __atomic_store_n(&n->size, st.st_size, __ATOMIC_RELAXED);
+    return n;
+};
+
+/* follows unlink or rmdir of name in dir in the backing directory.
+   a directory holding files the tree never saw stays there */
+static void backing_unlink(node *dir, const char *name, int flags) {
+    char path[PATH_MAX];
+
+    if (node_path(dir, name, path, sizeof(path)) == 0)
+        unlinkat(backing_fd, path, flags);
+};
+
+/* removes what a directory moved to a path in state st holds that
+   isn't on pass paths any more: files, and directories left empty.
+   takes dfd over */
+static void backing_prune(int dfd, unsigned st) {
+    DIR *d = fdopendir(dfd);
+    struct dirent *de;
+
+    if (d == NULL) {
+        close(dfd);
+        return;
+    };
+    while ((de = readdir(d)) != NULL) {
+        const char *s = de->d_name;
+        unsigned cst;
+        int fd;
+        if (strcmp(s, ".") == 0 || strcmp(s, "..") == 0) continue;
+        cst = rules_child(st, s, strlen(s));
+        fd = openat(dirfd(d), s, O_RDONLY | O_DIRECTORY | O_NOFOLLOW
+            | O_CLOEXEC);
+        if (fd >= 0) {
+            backing_prune(fd, cst);
+            if (rules_action(cst) != RULE_PASS)
+                unlinkat(dirfd(d), s, AT_REMOVEDIR);
+        } else if (rules_action(cst) != RULE_PASS) {
+            unlinkat(dirfd(d), s, 0);
+        };
+    };
+    closedir(d);
+};
+
+/* follows a rename in the backing directory: what's there moves
+   along, and a file moved off pass paths loses its data, as does
+   a pass file replaced by one that had none (it's left empty). a
+   moved directory keeps only the files still on pass paths */
+static void backing_rename(node *sdir, const char *sname, node *ddir,
+const char *dname) {
+    char from[PATH_MAX], to[PATH_MAX];
+    size_t dlen = strlen(dname);
+    unsigned rst = child_rstate(ddir, dname, dlen);
+    int pass = (rules_action(rst) == RULE_PASS);
+    int t = NULLFS_NONE, fd, res;
+
+    find_child(ddir, dname, dlen, &t, 0);
+    if (node_path(sdir, sname, from, sizeof(from))
+    || node_path(ddir, dname, to, sizeof(to)))
+        return;
+    res = renameat(backing_fd, from, backing_fd, to);
+    if (res && errno == ENOENT
+    && faccessat(backing_fd, from, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+        backing_mkdirs(to);
+        res = renameat(backing_fd, from, backing_fd, to);
+    };
+    if (t == NULLFS_DIR) {
+        fd = res ? -1 : openat(backing_fd, to, O_RDONLY | O_DIRECTORY
+            | O_NOFOLLOW | O_CLOEXEC);
+        if (fd >= 0) {
+            backing_prune(fd, rst);
+            if (! pass) unlinkat(backing_fd, to, AT_REMOVEDIR);
+        };
+    } else if (! pass) {
+        unlinkat(backing_fd, to, 0);
+    } else if (res) {
+        backing_mkdirs(to);
+        fd = openat(backing_fd, to, O_WRONLY | O_CREAT | O_TRUNC
+            | O_CLOEXEC, 0666);
+        if (fd >= 0) close(fd);
+    };
+};
+
+/* looks up name in dir, returns it referenced or NULL. names rules
+   say always exist are created here */
+static node *lookup_node(node *dir, const char *name) {
+    size_t len = strlen(name);
+    int t, action;
+    node *n;
+    if (dir == root && stats_name(dir, name)) {
+        get_node(stats_dir);
+        return stats_dir;
+    };
+    action = rules_action(child_rstate(dir, name, len));
+    if (action == RULE_ENOENT) return NULL;
+    n = find_child(dir, name, len, &t, 1);
+    if (n == NULL && (action == RULE_FILE || action == RULE_DIR)
+    && add_node(dir, name, (action == RULE_DIR) ? NULLFS_DIR
+    : NULLFS_FILE, &n) < 0)
+        n = NULL;
+    if (n == NULL && action == RULE_PASS && backing_fd >= 0)
+        n = pass_lookup(dir, name);
+    else if (n != NULL && pass_node(n))
+        pass_size(n, -1);
+    return n;
+};
+
+/* extends file to end unless it's already longer */
+static void grow_node(node *n, off_t end) {
+    off_t size = __atomic_load_n(&n->size, __ATOMIC_RELAXED);
+    while (size < end && ! __atomic_compare_exchange_n(&n->size, &size,
+    end, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+};
+
+/* attributes of node, shared by getattr, lookup and readdir so
+   listings carry everything a following stat would ask for */
+static void nullfs_fillstat(const node *n, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = node_ino(n);
+    if (n->type == NULLFS_DIR) {
+        stbuf->st_mode = S_IFDIR | ((n == stats_dir) ? 0555 : 0777);
+        stbuf->st_nlink = 3;
+    } else {
+        stbuf->st_mode = S_IFREG | ((n == stats_file) ? 0444 : 0666);
+        stbuf->st_nlink = 1;
+        stbuf->st_size = __atomic_load_n(&n->size, __ATOMIC_RELAXED);
+        /* zero-filled files are all hole */
+        if (! conf.zero_fill)
+            stbuf->st_blocks = (stbuf->st_size + 511) / 512;
+    };
+};
+
+static void nullfs_entry(const node *n, struct fuse_entry_param *e) {
+    memset(e, 0, sizeof(*e));
+    e->ino = node_ino(n);
+    e->attr_timeout = 1.0;
+    e->entry_timeout = 1.0;
+    nullfs_fillstat(n, &e->attr);
+};
+
+/* open directory handle. readdir continues from cursor node, which
+   sits in directory's children right after the last entry returned,
+   so entries added or removed between calls don't shift the stream.
+   off is the number of entries returned so far, "." and ".."
+   included */
+struct dirh {
+    node *dir;
+    node *cursor;
+    off_t off;
+    char *buf;          /* reply buffer */
+    size_t bufsize;
+};
+
+/* cursor list ops; caller holds dir_lock(dir) for writing */
+static void cursor_unlink(node *dir, node *c) {
+    if (c->prev) c->prev->next = c->next;
+    else dir->children = c->next;
+    if (c->next) c->next->prev = c->prev;
+};
+
+static void cursor_link(node *dir, node *after, node *c) {
+    if (after == NULL) {
+        link_child(dir, c);
+        return;
+    };
+    c->prev = after;
+    c->next = after->next;
+    if (after->next) after->next->prev = c;
+    after->next = c;
+};
+
+/* puts cursor after off'th entry, for rewinddir/seekdir */
+static void seek_dirh(dirh *dh, off_t off) {
+    node *after = NULL;
+
+    cursor_unlink(dh->dir, dh->cursor);
+    dh->off = (off < 2) ? off : 2;
+    for (node *n = dh->dir->children; n && dh->off < off; n = n->next) {
+        after = n;
+        if (n->type != NULLFS_NONE) dh->off++;
+    };
+    cursor_link(dh->dir, after, dh->cursor);
+};
+
+static size_t add_entry(fuse_req_t req, char *buf, size_t size,
+const char *name, const node *n, off_t off, int plus) {
+    struct fuse_entry_param e;
+
+    nullfs_entry(n, &e);
+    if (plus) return fuse_add_direntry_plus(req, buf, size, name, &e, off);
+    return fuse_add_direntry(req, buf, size, name, &e.attr, off);
+};
+
+/* fills dh's buffer with entries following the cursor and replies.
+   readdirplus takes a reference on every entry but "." and ".." */
+static void do_readdir(fuse_req_t req, size_t size, off_t off,
+struct fuse_file_info *fi, int plus) {
+    dirh *dh = (dirh *) (uintptr_t) fi->fh;
+    node *dir = dh->dir;
+    node *last;
+    size_t filled = 0;
+
+    if (dh->bufsize < size) {
+        char *buf = (char *) realloc(dh->buf, size);
+        if (buf == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        };
+        dh->buf = buf;
+        dh->bufsize = size;
+    };
+
+    pthread_rwlock_wrlock(dir_lock(dir));
+    if (dir->parent == NULL) {
+        pthread_rwlock_unlock(dir_lock(dir));
+        fuse_reply_err(req, ENOENT);
+        return;
+    };
+    if (off != dh->off) seek_dirh(dh, off);
+    while (dh->off < 2) {
+        size_t e = add_entry(req, dh->buf + filled, size - filled,
+            dh->off ? ".." : ".", dh->off ? dir->parent : dir,
+            dh->off + 1, plus);
+        if (e > size - filled) goto DO_READDIR_OUT;
+        filled += e;
+        dh->off++;
+    };
+    last = dh->cursor;
+    for (node *n = last->next; n; n = n->next) {
+        if (n->type == NULLFS_NONE) continue;   /* other cursor */
+        size_t e = add_entry(req, dh->buf + filled, size - filled,
+            n->name, n, dh->off + 1, plus);
+        if (e > size - filled) break;
+        if (plus) get_node(n);
+        filled += e;
+        dh->off++;
+        last = n;
+    };
+    if (last != dh->cursor) {
+        cursor_unlink(dir, dh->cursor);
+        cursor_link(dir, last, dh->cursor);
+    };
+DO_READDIR_OUT:
+    pthread_rwlock_unlock(dir_lock(dir));
+
+    fuse_reply_buf(req, dh->buf, filled);
+};
+
+/* per-thread buffer synthetic content is generated into */
+struct synth_buf {
+    char *p;
+    size_t cap;
+};
+
+static pthread_key_t synth_key;
+
+static void free_synth_buf(void *p) {
+    free(((synth_buf *) p)->p);
+    free(p);
+};
+
+/* replies with size bytes of n's content at offset, generated from
+   the vector boundary below offset */
+static void reply_synth(fuse_req_t req, const node *n, size_t size,
+off_t offset) {
+    synth_buf *b = (synth_buf *) pthread_getspecific(synth_key);
+    size_t skip = offset % SYNTH_VEC;
+    size_t len = (skip + size + SYNTH_VEC - 1) / SYNTH_VEC * SYNTH_VEC;
+
+    if (b == NULL) {
+        b = (synth_buf *) calloc(1, sizeof(synth_buf));
+        if (b == NULL || pthread_setspecific(synth_key, b) != 0) {
+            free(b);
+            fuse_reply_err(req, ENOMEM);
+            return;
+        };
+    };
+    if (b->cap < len) {
+        free(b->p);
+        b->p = (char *) aligned_alloc(SYNTH_VEC, len);
+        b->cap = (b->p != NULL) ? len : 0;
+        if (b->p == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        };
+    };
+    synth_fill(b->p, len, synth_seed(n->seed), offset - skip,
+        conf.synth);
+    fuse_reply_buf(req, b->p + skip, size);
+};
+
+static void nullfs_init(void *userdata, struct fuse_conn_info *conn) {
+    (void) userdata;
+
+    ll_init(conn);
+    /* answer ls -l with readdirplus, and only when the kernel sees
+       entries of the directory being looked up */
+    if (conn->capable & FUSE_CAP_READDIRPLUS)
+        conn->want |= FUSE_CAP_READDIRPLUS;
+    if (conn->capable & FUSE_CAP_READDIRPLUS_AUTO)
+        conn->want |= FUSE_CAP_READDIRPLUS_AUTO;
+    nullfs_io_init(conn);
+    nullfs_csum_init(conn);
+#ifdef FUSE_CAP_PASSTHROUGH
+    /* the kernel won't pass through with writeback cache on */
+    if (backing_fd >= 0 && ! nullfs_writeback
+    && (conn->capable & FUSE_CAP_PASSTHROUGH)) {
+        conn->want |= FUSE_CAP_PASSTHROUGH;
+        conn->max_backing_stack_depth = 1;
+        backing_kernel = 1;
+    };
+#endif
+    if (conf.synth) pthread_key_create(&synth_key, free_synth_buf);
+
+    nullfs_stats_init();
+    nullfs_delay_init();
+    root->rstate = rules.start;
+    root->seed = 0xcbf29ce484222325ULL ^ conf.synth_seed;
+    node *d = new_node(STATS_DIR_NAME, strlen(STATS_DIR_NAME),
+        NULLFS_DIR);
+    if (d != NULL) {
+        /* not linked into the tree, so not counted in root's sums */
+        d->parent = root;
+        if (add_node(d, STATS_FILE_NAME, NULLFS_FILE, &stats_file)
+        == NULLFS_NONE) {
+            stats_file->delta.files = 0;
+            stats_dir = d;
+        };
+    };
+};
+
+static void nullfs_lookup(fuse_req_t req, fuse_ino_t parent,
+const char *name) {
+    STATS_OP(STATS_LOOKUP);
+    node *dir = ino_node(parent);
+    struct fuse_entry_param e;
+    node *n;
+
+    if (dir->type != NULLFS_DIR) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    };
+    n = lookup_node(dir, name);
+    if (n == NULL) {
+        delay_reply_err(req, ENOENT);
+        return;
+    };
+    nullfs_entry(n, &e);
+    delay_reply_entry(req, &e);
+};
+
+static void nullfs_forget(fuse_req_t req, fuse_ino_t ino,
+uint64_t nlookup) {
+    STATS_OP(STATS_FORGET);
+
+    if (ino != FUSE_ROOT_ID) put_node(ino_node(ino), (int) nlookup);
+    fuse_reply_none(req);
+};
+
+static void nullfs_forget_multi(fuse_req_t req, size_t count,
+struct fuse_forget_data *forgets) {
+    STATS_OP(STATS_FORGET);
+
+    for (size_t i = 0; i < count; i++)
+        if (forgets[i].ino != FUSE_ROOT_ID)
+            put_node(ino_node(forgets[i].ino), (int) forgets[i].nlookup);
+    fuse_reply_none(req);
+};
+
+static void nullfs_getattr(fuse_req_t req, fuse_ino_t ino,
+struct fuse_file_info *fi) {
+    STATS_OP(STATS_GETATTR);
+    node *n = ino_node(ino);
+    pass_file *pf = pass_fi(n, fi);
+    struct stat st;
+
+    if (pf != NULL) pass_size(n, pf->fd);
+    else if (pass_node(n)) pass_size(n, -1);
+    nullfs_fillstat(n, &st);
+    delay_reply_attr(req, &st);
+};
+
+/* chmod, chown and utimens are no-ops, truncate sets size */
+static void nullfs_setattr(fuse_req_t req, fuse_ino_t ino,
+struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    STATS_OP(STATS_SETATTR);
+    node *n = ino_node(ino);
+    pass_file *pf = pass_fi(n, fi);
+
+    if ((to_set & FUSE_SET_ATTR_SIZE) && (pf != NULL || pass_node(n))) {
+        int fd = pf ? pf->fd : backing_open(n, O_WRONLY);
+        int res = (fd < 0) ? fd : ftruncate(fd, attr->st_size);
+        if (res) res = (fd < 0) ? -fd : errno;
+        if (pf == NULL && fd >= 0) close(fd);
+        if (res) {
+            fuse_reply_err(req, res);
+            return;
+        };
+    };
+    if ((to_set & FUSE_SET_ATTR_SIZE) && n->type == NULLFS_FILE
+    && n != stats_file) {
+        __atomic_store_n(&n->size, attr->st_size, __ATOMIC_RELAXED);
+        if (nullfs_csum && attr->st_size == 0) nullfs_csum_forget(ino);
+    };
+    nullfs_getattr(req, ino, fi);
+};
+
+static void nullfs_opendir(fuse_req_t req, fuse_ino_t ino,
+struct fuse_file_info *fi) {
+    STATS_OP(STATS_OPENDIR);
+    dirh *dh = (dirh *) calloc(1, sizeof(dirh));
+    node *dir = ino_node(ino);
+
+    if (dh == NULL || (dh->cursor = new_node("", 0, NULLFS_NONE)) == NULL) {
+        free(dh);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    };
+    get_node(dir);
+    dh->dir = dir;
+    pthread_rwlock_wrlock(dir_lock(dir));
+    link_child(dir, dh->cursor);
+    pthread_rwlock_unlock(dir_lock(dir));
+    fi->fh = (uintptr_t) dh;
+    fuse_reply_open(req, fi);
+};
+
+static void nullfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 off_t offset, struct fuse_file_info *fi) {
-    (void) buf;
-    (void) offset;
-    (void) fi;
+    STATS_OP(STATS_READDIR);
+    (void) ino;
+
+    do_readdir(req, size, offset, fi, 0);
+};
 
-    if (! nullfs_isfile(path)) return -ENOENT;
+static void nullfs_readdirplus(fuse_req_t req, fuse_ino_t ino,
+size_t size, off_t offset, struct fuse_file_info *fi) {
+    STATS_OP(STATS_READDIRPLUS);
+    (void) ino;
 
-    return (int) size;
+    do_readdir(req, size, offset, fi, 1);
 };
 
-static int nullfs_mkdir(const char *path, mode_t m) {
-    (void) m;
+static void nullfs_releasedir(fuse_req_t req, fuse_ino_t ino,
+struct fuse_file_info *fi) {
+    STATS_OP(STATS_RELEASEDIR);
+    dirh *dh = (dirh *) (uintptr_t) fi->fh;
+    (void) ino;
 
-    dirs.insert(string(path));
+    pthread_rwlock_wrlock(dir_lock(dh->dir));
+    cursor_unlink(dh->dir, dh->cursor);
+    pthread_rwlock_unlock(dir_lock(dh->dir));
+    put_node(dh->cursor);
+    put_node(dh->dir);
+    free(dh->buf);
+    free(dh);
+    fuse_reply_err(req, 0);
+};
 
-    return 0;
+static void nullfs_open(fuse_req_t req, fuse_ino_t ino,
+struct fuse_file_info *fi) {
+    STATS_OP(STATS_OPEN);
+
+    if (ino_node(ino)->type == NULLFS_DIR) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    };
+    if (ino_node(ino) == stats_file) {
+        stats_open(req, fi);
+        return;
+    };
+    if (nullfs_csum && (fi->flags & O_TRUNC)) nullfs_csum_forget(ino);
+    if (pass_node(ino_node(ino))) {
+        /* ENOENT when the backing file went away under us */
+        int res = pass_open(req, ino_node(ino), fi,
+            fi->flags & (O_ACCMODE | O_APPEND | O_TRUNC));
+        if (res < 0) {
+            fuse_reply_err(req, -res);
+            return;
+        };
+    };
+
+    fuse_reply_open(req, fi);
 };
 
-static int nullfs_create(const char *path, mode_t m,
+static void nullfs_release(fuse_req_t req, fuse_ino_t ino,
 struct fuse_file_info *fi) {
-    (void) m;
-    (void) fi;
+    STATS_OP(STATS_RELEASE);
 
-    files.insert(string(path));
+    if (ino_node(ino) == stats_file) {
+        stats_release(req, fi);
+        return;
+    };
+    if (pass_fi(ino_node(ino), fi) != NULL)
+        pass_release(req, ino_node(ino), fi);
+    fuse_reply_err(req, 0);
+};
 
-    return 0;
+static void nullfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+off_t offset, struct fuse_file_info *fi) {
+    STATS_OP(STATS_READ);
+    off_t end = __atomic_load_n(&ino_node(ino)->size, __ATOMIC_RELAXED);
+
+    if (ino_node(ino) == stats_file) {
+        stats_read(req, size, offset, fi);
+        return;
+    };
+    if (pass_fi(ino_node(ino), fi) != NULL) {
+        struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+        buf.buf[0].flags = (enum fuse_buf_flags)
+            (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        buf.buf[0].fd = pass_fi(ino_node(ino), fi)->fd;
+        buf.buf[0].pos = offset;
+        fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+        return;
+    };
+    if (offset >= end || (! conf.zero_fill && ! conf.synth)
+    || node_action(ino_node(ino)) == RULE_COUNT) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    };
+    if ((off_t) size > end - offset) size = end - offset;
+    stats_bytes(STATS_READ, size);
+    if (conf.synth) reply_synth(req, ino_node(ino), size, offset);
+    else nullfs_reply_zeroes(req, size);
+};
+
+/* files hold no data: all of a file is one hole */
+static void nullfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off,
+int whence, struct fuse_file_info *fi) {
+    STATS_OP(STATS_LSEEK);
+    off_t end = __atomic_load_n(&ino_node(ino)->size, __ATOMIC_RELAXED);
+    pass_file *pf = pass_fi(ino_node(ino), fi);
+
+    if (pf != NULL) {
+        off_t res = lseek(pf->fd, off, whence);
+        if (res < 0) fuse_reply_err(req, errno);
+        else fuse_reply_lseek(req, res);
+        return;
+    };
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+        fuse_reply_err(req, EINVAL);
+    else if (whence == SEEK_DATA || off >= end)
+        fuse_reply_err(req, ENXIO);
+    else
+        fuse_reply_lseek(req, off);
+};
+
+static void nullfs_write_buf(fuse_req_t req, fuse_ino_t ino,
+struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi) {
+    STATS_OP(STATS_WRITE);
+    pass_file *pf = pass_fi(ino_node(ino), fi);
+    ssize_t res;
+
+    if (pf != NULL) {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+        dst.buf[0].flags = (enum fuse_buf_flags)
+            (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        dst.buf[0].fd = pf->fd;
+        dst.buf[0].pos = offset;
+        res = fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags) 0);
+        if (res < 0) {
+            fuse_reply_err(req, (int) -res);
+            return;
+        };
+        if (res > 0) grow_node(ino_node(ino), offset + res);
+        count_write(ino_node(ino), res);
+        stats_bytes(STATS_WRITE, res);
+        delay_reply_write(req, res);
+        return;
+    };
+    res = nullfs_csum ? nullfs_csum_write(ino, bufv, offset)
+        : nullfs_discard(bufv);
+    if (res < 0) {
+        fuse_reply_err(req, (int) -res);
+        return;
+    };
+    if (node_action(ino_node(ino)) != RULE_DISCARD) {
+        if (res > 0) grow_node(ino_node(ino), offset + res);
+        count_write(ino_node(ino), res);
+        stats_bytes(STATS_WRITE, res);
+    };
+    nullfs_drop(ino, offset, res);
+    delay_reply_write(req, res);
+};
+
+static void nullfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+struct fuse_file_info *fi) {
+    STATS_OP(STATS_FSYNC);
+    pass_file *pf = pass_fi(ino_node(ino), fi);
+
+    if (pf != NULL && (datasync ? fdatasync(pf->fd) : fsync(pf->fd))) {
+        fuse_reply_err(req, errno);
+        return;
+    };
+    delay_reply_err(req, 0);
 };
 
-static int nullfs_mknod(const char *path, mode_t m, dev_t d) {
+static void nullfs_mkdir(fuse_req_t req, fuse_ino_t parent,
+const char *name, mode_t m) {
+    STATS_OP(STATS_MKDIR);
+    struct fuse_entry_param e;
+    node *n;
+    int res;
     (void) m;
-    (void) d;
 
-    files.insert(string(path));
+    res = add_node(ino_node(parent), name, NULLFS_DIR, &n);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    };
+    if (res != NULLFS_NONE) {
+        put_node(n);
+        fuse_reply_err(req, EEXIST);
+        return;
+    };
 
-    return 0;
+    nullfs_entry(n, &e);
+    delay_reply_entry(req, &e);
 };
 
-static int nullfs_unlink(const char *path) {
-    (void) path;
+static void nullfs_create(fuse_req_t req, fuse_ino_t parent,
+const char *name, mode_t m, struct fuse_file_info *fi) {
+    STATS_OP(STATS_CREATE);
+    struct fuse_entry_param e;
+    node *n;
+    int res;
+    (void) m;
 
-    files.erase(string(path));
+    res = add_node(ino_node(parent), name, NULLFS_FILE, &n);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    };
+    if (res == NULLFS_DIR) {
+        put_node(n);
+        fuse_reply_err(req, EISDIR);
+        return;
+    };
+    if (nullfs_csum && res == NULLFS_FILE && (fi->flags & O_TRUNC))
+        nullfs_csum_forget(node_ino(n));
+    if (pass_node(n)) {
+        res = pass_open(req, n, fi, O_CREAT
+            | (fi->flags & (O_ACCMODE | O_APPEND | O_TRUNC)));
+        if (res < 0) {
+            put_node(n);
+            fuse_reply_err(req, -res);
+            return;
+        };
+    };
 
-    return 0;
+    nullfs_entry(n, &e);
+    delay_reply_create(req, &e, fi);
 };
 
-static int nullfs_rename(const char *src, const char *dst) {
-    (void) src;
-    (void) dst;
+static void nullfs_mknod(fuse_req_t req, fuse_ino_t parent,
+const char *name, mode_t m, dev_t d) {
+    STATS_OP(STATS_MKNOD);
+    struct fuse_entry_param e;
+    node *n;
+    int res;
+    (void) m;
+    (void) d;
 
-    if (nullfs_isdir(src)) {
-        dirs.erase(string(src));
-        dirs.insert(string(dst));
-    } else if (nullfs_isfile(src)) {
-        files.erase(string(src));
-        files.insert(string(dst));
-    } else {
-        return -ENOENT;
+    res = add_node(ino_node(parent), name, NULLFS_FILE, &n);
+    if (res < 0) {
+        fuse_reply_err(req, -res);
+        return;
+    };
+    if (res != NULLFS_NONE) {
+        put_node(n);
+        fuse_reply_err(req, EEXIST);
+        return;
+    };
+    if (pass_node(n)) {
+        /* open() won't create it */
+        int fd = backing_open(n, O_WRONLY | O_CREAT);
+        if (fd < 0) {
+            put_node(n);
+            fuse_reply_err(req, -fd);
+            return;
+        };
+        close(fd);
     };
 
-    return 0;
+    nullfs_entry(n, &e);
+    delay_reply_entry(req, &e);
 };
 
-static int nullfs_truncate(const char *path, off_t o) {
-    (void) path;
-    (void) o;
+static void nullfs_unlink(fuse_req_t req, fuse_ino_t parent,
+const char *name) {
+    STATS_OP(STATS_UNLINK);
+    node *dir = ino_node(parent);
+    int res = del_node(dir, name, NULLFS_FILE);
 
-    return 0;
+    if (res == 0 && backing_fd >= 0
+    && rules_action(child_rstate(dir, name, strlen(name))) == RULE_PASS)
+        backing_unlink(dir, name, 0);
+    delay_reply_err(req, -res);
 };
 
-static int nullfs_chmod(const char *path, mode_t m) {
-    (void) path;
-    (void) m;
+static void nullfs_rmdir(fuse_req_t req, fuse_ino_t parent,
+const char *name) {
+    STATS_OP(STATS_RMDIR);
+    node *dir = ino_node(parent);
+    int res = del_node(dir, name, NULLFS_DIR);
 
-    return 0;
+    if (res == 0 && backing_fd >= 0)
+        backing_unlink(dir, name, AT_REMOVEDIR);
+    delay_reply_err(req, -res);
 };
 
-static int nullfs_chown(const char *path, uid_t u, gid_t g) {
-    (void) path;
-    (void) u;
-    (void) g;
+static void nullfs_rename(fuse_req_t req, fuse_ino_t parent,
+const char *name, fuse_ino_t newparent, const char *newname,
+unsigned int flags) {
+    STATS_OP(STATS_RENAME);
+    int res = move_node(ino_node(parent), name, ino_node(newparent),
+        newname, flags);
 
-    return 0;
+    if (res == 0 && backing_fd >= 0)
+        backing_rename(ino_node(parent), name, ino_node(newparent),
+            newname);
+    delay_reply_err(req, -res);
 };
 
-static int nullfs_utimens(const char *path, const struct timespec ts[2]) {
-    (void) path;
-    (void) ts;
+#define COUNT_XATTR_BYTES "user.nullfs.bytes"
+#define COUNT_XATTR_WRITES "user.nullfs.writes"
+#define COUNT_XATTR_FILES "user.nullfs.files"
 
-    return 0;
+static void reply_xattr(fuse_req_t req, const char *buf, size_t len,
+size_t size) {
+    if (size == 0) fuse_reply_xattr(req, len);
+    else if (size < len) fuse_reply_err(req, ERANGE);
+    else fuse_reply_buf(req, buf, len);
 };
 
-static struct fuse_operations nullfs_oper;
+/* subtree sums of any node as decimal numbers with -o counters,
+   and user.nullfs.crc32c of files with -o checksum */
+static void nullfs_getxattr(fuse_req_t req, fuse_ino_t ino,
+const char *name, size_t size) {
+    STATS_OP(STATS_GETXATTR);
+    node *n = ino_node(ino);
+    const uint64_t *v = NULL;
+    char buf[24];
+    int len;
 
-int main(int argc, char *argv[]) {
+    if (n == stats_dir || n == stats_file) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    };
+    if (! conf.counters) v = NULL;
+    else if (strcmp(name, COUNT_XATTR_BYTES) == 0) v = &n->sum.bytes;
+    else if (strcmp(name, COUNT_XATTR_WRITES) == 0) v = &n->sum.writes;
+    else if (strcmp(name, COUNT_XATTR_FILES) == 0) v = &n->sum.files;
+    if (v != NULL) {
+        pthread_mutex_lock(&count_lock);
+        count_fold();
+        len = snprintf(buf, sizeof(buf), "%llu", (unsigned long long) *v);
+        pthread_mutex_unlock(&count_lock);
+        reply_xattr(req, buf, len, size);
+    } else if (n->type != NULLFS_FILE) {
+        fuse_reply_err(req, ENODATA);
+    } else {
+        nullfs_csum_getxattr(req, ino, name, size);
+    };
+};
+
+static void nullfs_listxattr(fuse_req_t req, fuse_ino_t ino,
+size_t size) {
+    STATS_OP(STATS_LISTXATTR);
+    static const char names[] = COUNT_XATTR_BYTES "\0"
+        COUNT_XATTR_WRITES "\0" COUNT_XATTR_FILES "\0"
+        NULLFS_CSUM_XATTR;
+    node *n = ino_node(ino);
+    const char *p = names;
+    size_t len = sizeof(names) - sizeof(NULLFS_CSUM_XATTR);
+
+    if (! conf.counters) {
+        p += len;
+        len = 0;
+    };
+    if (n == stats_dir || n == stats_file) len = 0;
+    else if (n->type == NULLFS_FILE && nullfs_csum)
+        len += sizeof(NULLFS_CSUM_XATTR);
+    reply_xattr(req, p, len, size);
+};
+
+static struct fuse_lowlevel_ops nullfs_oper;
+
+static void init_oper(void) {
+    nullfs_oper.init = nullfs_init;
+    nullfs_oper.lookup = nullfs_lookup;
+    nullfs_oper.forget = nullfs_forget;
+    nullfs_oper.forget_multi = nullfs_forget_multi;
     nullfs_oper.getattr = nullfs_getattr;
+    nullfs_oper.setattr = nullfs_setattr;
+    nullfs_oper.opendir = nullfs_opendir;
     nullfs_oper.readdir = nullfs_readdir;
+    nullfs_oper.readdirplus = nullfs_readdirplus;
+    nullfs_oper.releasedir = nullfs_releasedir;
     nullfs_oper.open = nullfs_open;
+    nullfs_oper.release = nullfs_release;
     nullfs_oper.read = nullfs_read;
-    nullfs_oper.write = nullfs_write;
+    nullfs_oper.write_buf = nullfs_write_buf;
+    nullfs_oper.fsync = nullfs_fsync;
+    nullfs_oper.lseek = nullfs_lseek;
     nullfs_oper.create = nullfs_create;
     nullfs_oper.mknod = nullfs_mknod;
     nullfs_oper.mkdir = nullfs_mkdir;
     nullfs_oper.unlink = nullfs_unlink;
-    nullfs_oper.rmdir = nullfs_unlink;
-    nullfs_oper.truncate = nullfs_truncate;
+    nullfs_oper.rmdir = nullfs_rmdir;
     nullfs_oper.rename = nullfs_rename;
-    nullfs_oper.chmod = nullfs_chmod;
-    nullfs_oper.utimens = nullfs_utimens;
-    return fuse_main(argc, argv, &nullfs_oper, NULL);
+    nullfs_oper.getxattr = nullfs_getxattr;
+    nullfs_oper.listxattr = nullfs_listxattr;
+};
+
+#ifndef NULLFS_NO_MAIN
+int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    if (fuse_opt_parse(&args, &conf, nullfs_opts, NULL) == -1
+    || fuse_opt_parse(&args, &delay_conf, delay_opts, NULL) == -1
+    || fuse_opt_parse(&args, &nullfs_writeback, nullfs_io_opts, NULL)
+    == -1 || fuse_opt_parse(&args, NULL, rules_opts, rules_opt_proc)
+    == -1 || fuse_opt_parse(&args, &nullfs_csum, nullfs_csum_opts, NULL)
+    == -1)
+        return 1;
+    if (rule_n == 0) rules_add(RULE_FILE, "foo");
+    if (rules_compile()) return 1;
+    if (conf.backing != NULL && (backing_fd = open(conf.backing,
+    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        perror(conf.backing);
+        return 1;
+    };
+    init_oper();
+    return ll_main(&args, &nullfs_oper, sizeof(nullfs_oper));
 };
+#endif
 
 /* vi:set sw=4 et tw=72: */
@@ -0,0 +1,433 @@
+/*
+    Checksums of discarded data, for nullfs daemons.
+
+    With -o checksum every write's payload is run through CRC-32C
+    before it's dropped, so a producer can be checked for writing
+    the right bytes without anything being stored. The digest of a
+    file is its getxattr "user.nullfs.crc32c":
+
+      "1c291ca3 1048576"    CRC-32C and size of the data written,
+                            when it covers 0..size with no gaps
+      "partial 65536 3"     bytes written so far, in 3 ranges
+      "invalid 1052672"     some byte was written twice, or the
+                            file was scattered over too many ranges
+
+    Writes may come in any order (parallel writers, writeback,
+    readahead-sized chunks): each file keeps its written ranges with
+    a CRC each, sorted, and ranges that meet are merged by combining
+    their CRCs, which takes O(log n) multiplications modulo the CRC
+    polynomial and no data. In-order writes just extend the last
+    range.
+
+    On x86-64 CPUs with SSE 4.2 the CRC is computed by the crc32
+    instruction in three interleaved streams, joined the same way
+    ranges are, which keeps up with memory bandwidth; elsewhere a
+    slicing-by-8 table is used. Payload has to be in memory to be
+    checksummed, so splicing writes to /dev/null is turned off.
+*/
+
+#ifndef _NULLFS_CSUM_H
+#define _NULLFS_CSUM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define NULLFS_CSUM_XATTR "user.nullfs.crc32c"
+#define CSUM_POLY 0x82f63b78    /* CRC-32C, reflected */
+#define CSUM_BLOCK 4096         /* bytes per stream per round */
+#define CSUM_BUCKET_BITS 16
+#define CSUM_LOCKS 64
+#define CSUM_MAX_RANGES 65536
+#define CSUM_X2N 67             /* shifts by up to 2^64 bytes */
+
+static int nullfs_csum = 0;
+
+static const struct fuse_opt nullfs_csum_opts[] = {
+    {"checksum", 0, 1},
+    FUSE_OPT_END
+};
+
+struct csum_range {
+    uint64_t start, end;
+    uint32_t crc;
+};
+
+/* per-file state: ranges written, sorted and neither overlapping
+   nor touching */
+struct csum_file {
+    fuse_ino_t ino;
+    struct csum_file *next;     /* in hash bucket */
+    struct csum_range *r;
+    unsigned n, cap;
+    int invalid;                /* overlap or too many ranges */
+    uint64_t bytes;
+};
+
+static struct csum_file **csum_tab = NULL;
+static pthread_mutex_t csum_locks[CSUM_LOCKS];
+static uint32_t csum_x2n[CSUM_X2N];    /* x^(2^n) modulo polynomial */
+static uint32_t csum_table[8][256];
+static uint32_t csum_block1, csum_block2;   /* shift by 1, 2 blocks */
+static uint32_t (*csum_fn)(uint32_t, const unsigned char *, size_t);
+static pthread_key_t csum_buf_key;
+
+/* a * b modulo polynomial, bit-reflected */
+static inline uint32_t csum_mult(uint32_t a, uint32_t b) {
+    uint32_t m = 1U << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CSUM_POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^(8 * len) modulo polynomial: shifts a CRC by len zero bytes;
+   x^(2^n) doesn't come round to x every 32 squarings for CRC-32C
+   as it does for zlib's polynomial, so there's an entry for each n */
+static inline uint32_t csum_shift(uint64_t len) {
+    uint32_t p = 1U << 31;      /* x^0 */
+    int k = 3;
+
+    for (; len; len >>= 1, k++)
+        if (len & 1) p = csum_mult(csum_x2n[k], p);
+    return p;
+}
+
+/* CRC of a followed by b, from CRCs of both and length of b */
+static inline uint32_t csum_combine(uint32_t a, uint32_t b,
+uint64_t len_b) {
+    return csum_mult(csum_shift(len_b), a) ^ b;
+}
+
+static uint32_t csum_sw(uint32_t crc, const unsigned char *p,
+size_t len) {
+    while (len && ((uintptr_t) p & 7)) {
+        crc = csum_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = csum_table[7][w & 0xff] ^ csum_table[6][(w >> 8) & 0xff]
+            ^ csum_table[5][(w >> 16) & 0xff]
+            ^ csum_table[4][(w >> 24) & 0xff]
+            ^ csum_table[3][(w >> 32) & 0xff]
+            ^ csum_table[2][(w >> 40) & 0xff]
+            ^ csum_table[1][(w >> 48) & 0xff] ^ csum_table[0][w >> 56];
+    }
+    while (len--) crc = csum_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* crc32 has 3 cycles latency and 1 cycle throughput: three streams
+   over neighbouring blocks keep it busy, then the second and first
+   stream are shifted over the blocks after them and all xored */
+__attribute__((target("sse4.2")))
+static uint32_t csum_hw(uint32_t crc, const unsigned char *p,
+size_t len) {
+    unsigned long long c0 = crc, c1, c2;
+
+    for (; len >= 3 * CSUM_BLOCK; p += 3 * CSUM_BLOCK,
+    len -= 3 * CSUM_BLOCK) {
+        c1 = c2 = 0;
+        for (size_t i = 0; i < CSUM_BLOCK; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + CSUM_BLOCK + i, 8);
+            memcpy(&w2, p + 2 * CSUM_BLOCK + i, 8);
+            c0 = __builtin_ia32_crc32di(c0, w0);
+            c1 = __builtin_ia32_crc32di(c1, w1);
+            c2 = __builtin_ia32_crc32di(c2, w2);
+        }
+        c0 = csum_mult(csum_block2, (uint32_t) c0)
+            ^ csum_mult(csum_block1, (uint32_t) c1) ^ (uint32_t) c2;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c0 = __builtin_ia32_crc32di(c0, w);
+    }
+    while (len--) c0 = __builtin_ia32_crc32qi((uint32_t) c0, *p++);
+    return (uint32_t) c0;
+}
+#endif
+
+static inline void csum_free_buf(void *p) {
+    free(p);
+}
+
+/* called from init handler, after nullfs_io_init() */
+static inline void nullfs_csum_init(struct fuse_conn_info *conn) {
+    uint32_t p = 1U << 30;      /* x^1 */
+
+    if (! nullfs_csum || csum_tab != NULL) return;
+    csum_tab = (struct csum_file **) calloc(1 << CSUM_BUCKET_BITS,
+        sizeof(*csum_tab));
+    if (csum_tab == NULL) {
+        fprintf(stderr, "checksum: out of memory, turned off\n");
+        nullfs_csum = 0;
+        return;
+    }
+    for (int i = 0; i < CSUM_LOCKS; i++)
+        pthread_mutex_init(&csum_locks[i], NULL);
+    pthread_key_create(&csum_buf_key, csum_free_buf);
+    conn->want &= ~FUSE_CAP_SPLICE_READ;
+
+    for (int n = 0; n < CSUM_X2N; n++) {
+        csum_x2n[n] = p;
+        p = csum_mult(p, p);
+    }
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ CSUM_POLY : c >> 1;
+        csum_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            csum_table[t][i] = (csum_table[t - 1][i] >> 8)
+                ^ csum_table[0][csum_table[t - 1][i] & 0xff];
+    csum_block1 = csum_shift(CSUM_BLOCK);
+    csum_block2 = csum_shift(2 * CSUM_BLOCK);
+    csum_fn = csum_sw;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2")) csum_fn = csum_hw;
+#endif
+}
+
+/* CRC-32C of len bytes at p */
+static inline uint32_t nullfs_crc32c(const void *p, size_t len) {
+    return ~csum_fn(~0U, (const unsigned char *) p, len);
+}
+
+static inline size_t csum_bucket(fuse_ino_t ino) {
+    return (size_t) (((uint64_t) ino * 0x9e3779b97f4a7c15ULL)
+        >> (64 - CSUM_BUCKET_BITS));
+}
+
+static inline pthread_mutex_t *csum_lock(size_t b) {
+    return &csum_locks[b & (CSUM_LOCKS - 1)];
+}
+
+/* finds file's state, adding it if add is set; caller holds lock */
+static inline struct csum_file *csum_find(size_t b, fuse_ino_t ino,
+int add) {
+    struct csum_file *f;
+
+    for (f = csum_tab[b]; f != NULL; f = f->next)
+        if (f->ino == ino) return f;
+    if (! add || (f = (struct csum_file *) calloc(1, sizeof(*f)))
+    == NULL)
+        return NULL;
+    f->ino = ino;
+    f->next = csum_tab[b];
+    csum_tab[b] = f;
+    return f;
+}
+
+/* records range [start, end) with crc; caller holds lock */
+static inline void csum_add(struct csum_file *f, uint64_t start,
+uint64_t end, uint32_t crc) {
+    unsigned lo = 0, hi = f->n, i;
+    struct csum_range *r;
+
+    f->bytes += end - start;
+    if (f->invalid) return;
+    /* first range ending at or after start; in-order writes meet
+       the last one */
+    if (f->n && f->r[f->n - 1].end <= start) {
+        lo = f->n - (f->r[f->n - 1].end == start);
+    } else {
+        while (lo < hi) {
+            unsigned mid = (lo + hi) / 2;
+            if (f->r[mid].end < start) lo = mid + 1;
+            else hi = mid;
+        }
+    }
+    i = lo;
+    r = f->r + i;
+
+    if (i < f->n && r->end == start) {
+        /* appends to r, maybe closing the gap to the next one */
+        if (i + 1 < f->n && r[1].start < end) {
+            f->invalid = 1;
+            return;
+        }
+        r->crc = csum_combine(r->crc, crc, end - start);
+        r->end = end;
+        if (i + 1 < f->n && r[1].start == end) {
+            r->crc = csum_combine(r->crc, r[1].crc,
+                r[1].end - r[1].start);
+            r->end = r[1].end;
+            memmove(r + 1, r + 2, (f->n - i - 2) * sizeof(*r));
+            f->n--;
+        }
+    } else if (i < f->n && r->start < end) {
+        f->invalid = 1;
+    } else if (i < f->n && r->start == end) {
+        r->crc = csum_combine(crc, r->crc, r->end - r->start);
+        r->start = start;
+    } else {
+        if (f->n == f->cap) {
+            unsigned cap = f->cap ? f->cap * 2 : 4;
+            struct csum_range *p = NULL;
+            if (cap <= CSUM_MAX_RANGES)
+                p = (struct csum_range *) realloc(f->r,
+                    cap * sizeof(*p));
+            if (p == NULL) {
+                f->invalid = 1;
+                return;
+            }
+            f->r = p;
+            f->cap = cap;
+            r = f->r + i;
+        }
+        memmove(r + 1, r, (f->n - i) * sizeof(*r));
+        r->start = start;
+        r->end = end;
+        r->crc = crc;
+        f->n++;
+    }
+}
+
+/* checksums and consumes write payload; returns number of bytes
+   written or -errno */
+static inline ssize_t nullfs_csum_write(fuse_ino_t ino,
+struct fuse_bufvec *bufv, off_t off) {
+    size_t size = fuse_buf_size(bufv), b;
+    const void *p = bufv->buf[0].mem;
+    struct csum_file *f;
+    uint32_t crc;
+
+    if (bufv->count != 1 || (bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+        /* payload isn't one piece of memory, copy it out */
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        size_t *buf = (size_t *) pthread_getspecific(csum_buf_key);
+        ssize_t res;
+        if (buf == NULL || buf[0] < size) {
+            free(buf);
+            buf = (size_t *) malloc(sizeof(size_t) + size);
+            pthread_setspecific(csum_buf_key, buf);
+            if (buf == NULL) return -ENOMEM;
+            buf[0] = size;
+        }
+        dst.buf[0].mem = buf + 1;
+        res = fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags) 0);
+        if (res < 0) return res;
+        size = res;
+        p = buf + 1;
+    }
+    if (size == 0) return 0;
+
+    crc = nullfs_crc32c(p, size);
+    b = csum_bucket(ino);
+    pthread_mutex_lock(csum_lock(b));
+    f = csum_find(b, ino, 1);
+    if (f != NULL) csum_add(f, off, off + size, crc);
+    pthread_mutex_unlock(csum_lock(b));
+    return size;
+}
+
+/* forgets file's checksum: unlinked, truncated or inode gone */
+static inline void nullfs_csum_forget(fuse_ino_t ino) {
+    size_t b = csum_bucket(ino);
+    struct csum_file **p, *f;
+
+    pthread_mutex_lock(csum_lock(b));
+    for (p = &csum_tab[b]; (f = *p) != NULL; p = &f->next) {
+        if (f->ino == ino) {
+            *p = f->next;
+            free(f->r);
+            free(f);
+            break;
+        }
+    }
+    pthread_mutex_unlock(csum_lock(b));
+}
+
+/* moves checksum of file from to file to, for daemons whose inode
+   numbers go with names */
+static inline void nullfs_csum_move(fuse_ino_t from, fuse_ino_t to) {
+    size_t fb = csum_bucket(from), tb = csum_bucket(to);
+    struct csum_file **p, *f = NULL;
+
+    nullfs_csum_forget(to);
+    pthread_mutex_lock(csum_lock(fb));
+    for (p = &csum_tab[fb]; *p != NULL; p = &(*p)->next) {
+        if ((*p)->ino == from) {
+            f = *p;
+            *p = f->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(csum_lock(fb));
+    if (f == NULL) return;
+    f->ino = to;
+    pthread_mutex_lock(csum_lock(tb));
+    f->next = csum_tab[tb];
+    csum_tab[tb] = f;
+    pthread_mutex_unlock(csum_lock(tb));
+}
+
+/* writes digest text of file to buf, returns its length */
+static inline int csum_format(fuse_ino_t ino, char *buf, size_t size) {
+    size_t b = csum_bucket(ino);
+    struct csum_file *f;
+    int len;
+
+    pthread_mutex_lock(csum_lock(b));
+    f = csum_find(b, ino, 0);
+    if (f == NULL)
+        len = snprintf(buf, size, "00000000 0");
+    else if (f->invalid)
+        len = snprintf(buf, size, "invalid %llu",
+            (unsigned long long) f->bytes);
+    else if (f->n == 1 && f->r[0].start == 0)
+        len = snprintf(buf, size, "%08x %llu", f->r[0].crc,
+            (unsigned long long) f->r[0].end);
+    else
+        len = snprintf(buf, size, "partial %llu %u",
+            (unsigned long long) f->bytes, f->n);
+    pthread_mutex_unlock(csum_lock(b));
+    return len;
+}
+
+/* getxattr handler part for regular files */
+static inline void nullfs_csum_getxattr(fuse_req_t req, fuse_ino_t ino,
+const char *name, size_t size) {
+    char buf[64];
+    int len;
+
+    if (! nullfs_csum || strcmp(name, NULLFS_CSUM_XATTR) != 0) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+    len = csum_format(ino, buf, sizeof(buf));
+    if (size == 0) fuse_reply_xattr(req, len);
+    else if (size < (size_t) len) fuse_reply_err(req, ERANGE);
+    else fuse_reply_buf(req, buf, len);
+}
+
+/* listxattr handler part for regular files */
+static inline void nullfs_csum_listxattr(fuse_req_t req, size_t size) {
+    size_t len = nullfs_csum ? sizeof(NULLFS_CSUM_XATTR) : 0;
+
+    if (size == 0) fuse_reply_xattr(req, len);
+    else if (size < len) fuse_reply_err(req, ERANGE);
+    else fuse_reply_buf(req, NULLFS_CSUM_XATTR, len);
+}
+
+#endif /* _NULLFS_CSUM_H */
+
+/* vi:set sw=4 et tw=72: */
@@ -0,0 +1,318 @@
+/*
+    Slow storage emulation for nullfs daemons.
+
+    With -o latency=US every write, fsync and metadata reply is held
+    back by a latency drawn from latency_dist (fixed, uniform over
+    0..2*US or exp with mean US). With -o bandwidth=BPS write replies
+    also wait for their bytes to pass a token bucket of BPS bytes a
+    second holding up to burst= bytes (1MiB by default).
+
+    Handlers don't sleep: a held reply is put on a timer wheel and
+    sent by one timer thread when it's due, so any number of slow
+    requests can be in flight with a handful of workers. Bucket is
+    a lock-free virtual clock: each write advances the time its
+    bytes finish passing through by bytes / BPS.
+*/
+
+#ifndef _NULLFS_DELAY_H
+#define _NULLFS_DELAY_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+enum delay_dist { DELAY_FIXED = 0, DELAY_UNIFORM, DELAY_EXP };
+
+struct delay_config {
+    unsigned latency;               /* us */
+    int dist;                       /* delay_dist */
+    unsigned long long bandwidth;   /* bytes/s, 0: unlimited */
+    unsigned long long burst;       /* bytes */
+};
+
+static struct delay_config delay_conf = { 0, DELAY_FIXED, 0, 1 << 20 };
+
+#define DELAY_OPT(t, p, v) { t, offsetof(struct delay_config, p), v }
+static const struct fuse_opt delay_opts[] = {
+    DELAY_OPT("latency=%u", latency, 0),
+    DELAY_OPT("latency_dist=fixed", dist, DELAY_FIXED),
+    DELAY_OPT("latency_dist=uniform", dist, DELAY_UNIFORM),
+    DELAY_OPT("latency_dist=exp", dist, DELAY_EXP),
+    DELAY_OPT("bandwidth=%llu", bandwidth, 0),
+    DELAY_OPT("burst=%llu", burst, 0),
+    FUSE_OPT_END
+};
+
+enum delay_kind { DELAY_ERR, DELAY_WRITE, DELAY_ENTRY, DELAY_CREATE,
+    DELAY_ATTR };
+
+/* held reply */
+struct delayed {
+    struct delayed *next;
+    uint64_t due;                   /* ns, CLOCK_MONOTONIC */
+    fuse_req_t req;
+    int kind;
+    union {
+        int err;
+        size_t count;
+        struct stat attr;
+        struct {
+            struct fuse_entry_param e;
+            struct fuse_file_info fi;
+        } entry;
+    } u;
+};
+
+/* wheel of 4096 slots, 65.5us apart; replies due more than a turn
+   ahead just stay in their slot for another turn */
+#define WHEEL_BITS 12
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_TICK_SHIFT 16
+#define WHEEL_TICK (1 << WHEEL_TICK_SHIFT)     /* ns */
+
+static struct delayed *wheel[WHEEL_SIZE];
+static uint64_t wheel_tick;         /* last tick swept */
+static size_t wheel_pending;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t delay_bw_next;      /* bucket's virtual clock, ns */
+
+static inline int delay_on(void) {
+    return delay_conf.latency != 0 || delay_conf.bandwidth != 0;
+}
+
+static inline uint64_t delay_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* latency sample in ns */
+static inline uint64_t delay_latency(void) {
+    static __thread uint64_t x;
+    uint64_t ns = (uint64_t) delay_conf.latency * 1000;
+    double u;
+
+    if (delay_conf.dist == DELAY_FIXED) return ns;
+    if (x == 0) x = (uintptr_t) &x ^ delay_clock();
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    u = (x >> 11) * (1.0 / 9007199254740992.0);     /* [0, 1) */
+    if (delay_conf.dist == DELAY_UNIFORM)
+        return (uint64_t) (2 * ns * u);
+    return (uint64_t) (-log1p(-u) * ns);
+}
+
+/* time at which bytes written now have passed the bucket */
+static inline uint64_t delay_transfer(uint64_t now, size_t bytes) {
+    double ns_per_byte;
+    uint64_t cost, floor, next, end;
+
+    if (delay_conf.bandwidth == 0) return now;
+    ns_per_byte = 1e9 / delay_conf.bandwidth;
+    cost = (uint64_t) (bytes * ns_per_byte);
+    floor = (uint64_t) (delay_conf.burst * ns_per_byte);
+    floor = (now > floor) ? now - floor : 0;
+    next = __atomic_load_n(&delay_bw_next, __ATOMIC_RELAXED);
+    do {
+        end = ((next > floor) ? next : floor) + cost;
+    } while (! __atomic_compare_exchange_n(&delay_bw_next, &next, end,
+        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return (end > now) ? end : now;
+}
+
+static inline void delay_send(struct delayed *d) {
+    switch (d->kind) {
+    case DELAY_ERR:
+        fuse_reply_err(d->req, d->u.err);
+        break;
+    case DELAY_WRITE:
+        fuse_reply_write(d->req, d->u.count);
+        break;
+    case DELAY_ENTRY:
+        fuse_reply_entry(d->req, &d->u.entry.e);
+        break;
+    case DELAY_CREATE:
+        fuse_reply_create(d->req, &d->u.entry.e, &d->u.entry.fi);
+        break;
+    case DELAY_ATTR:
+        fuse_reply_attr(d->req, &d->u.attr, 1.0);
+        break;
+    }
+    free(d);
+}
+
+/* timer thread: every tick, sends replies from slots passed since
+   the last sweep that are due; sleeps on wheel_cond while nothing
+   is pending */
+static inline void *delay_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&wheel_lock);
+    for (;;) {
+        struct delayed *fire = NULL, *d, **p;
+        struct timespec ts;
+        uint64_t now, t, n;
+
+        while (wheel_pending == 0)
+            pthread_cond_wait(&wheel_cond, &wheel_lock);
+        pthread_mutex_unlock(&wheel_lock);
+        t = (wheel_tick + 1) << WHEEL_TICK_SHIFT;
+        ts.tv_sec = t / 1000000000;
+        ts.tv_nsec = t % 1000000000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        now = delay_clock();
+        pthread_mutex_lock(&wheel_lock);
+
+        n = (now >> WHEEL_TICK_SHIFT) - wheel_tick;
+        if (n > WHEEL_SIZE) n = WHEEL_SIZE;
+        for (t = wheel_tick + 1; n > 0; t++, n--) {
+            for (p = &wheel[t & (WHEEL_SIZE - 1)]; (d = *p) != NULL; ) {
+                if (d->due <= now) {
+                    *p = d->next;
+                    d->next = fire;
+                    fire = d;
+                    wheel_pending--;
+                } else {
+                    p = &d->next;
+                }
+            }
+        }
+        if ((now >> WHEEL_TICK_SHIFT) > wheel_tick)
+            wheel_tick = now >> WHEEL_TICK_SHIFT;
+
+        pthread_mutex_unlock(&wheel_lock);
+        while ((d = fire) != NULL) {
+            fire = d->next;
+            delay_send(d);
+        }
+        pthread_mutex_lock(&wheel_lock);
+    }
+    return NULL;
+}
+
+/* called from init handler */
+static inline void nullfs_delay_init(void) {
+    pthread_t t;
+
+    if (! delay_on()) return;
+    wheel_tick = delay_clock() >> WHEEL_TICK_SHIFT;
+    if (pthread_create(&t, NULL, delay_thread, NULL) == 0)
+        pthread_detach(t);
+    else
+        delay_conf.latency = delay_conf.bandwidth = 0;
+}
+
+/* sends d now if it's due, otherwise puts it on the wheel */
+static inline void delay_hold(struct delayed *d, uint64_t now) {
+    /* first tick starting at or after due, so that the sweep of its
+       slot never finds it early */
+    uint64_t t = (d->due + WHEEL_TICK - 1) >> WHEEL_TICK_SHIFT;
+
+    if (d->due <= now) {
+        delay_send(d);
+        return;
+    }
+    pthread_mutex_lock(&wheel_lock);
+    if (t <= wheel_tick) t = wheel_tick + 1;    /* slot already swept */
+    d->next = wheel[t & (WHEEL_SIZE - 1)];
+    wheel[t & (WHEEL_SIZE - 1)] = d;
+    if (wheel_pending++ == 0) pthread_cond_signal(&wheel_cond);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+/* allocates held reply; NULL when delays are off or there's no
+   memory, and the caller replies right away */
+static inline struct delayed *delay_new(fuse_req_t req, int kind) {
+    struct delayed *d;
+
+    if (! delay_on()) return NULL;
+    d = (struct delayed *) malloc(sizeof(*d));
+    if (d == NULL) return NULL;
+    d->req = req;
+    d->kind = kind;
+    return d;
+}
+
+static inline void delay_reply_err(fuse_req_t req, int err) {
+    struct delayed *d = delay_new(req, DELAY_ERR);
+    uint64_t now;
+
+    if (d == NULL) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    now = delay_clock();
+    d->u.err = err;
+    d->due = now + delay_latency();
+    delay_hold(d, now);
+}
+
+static inline void delay_reply_write(fuse_req_t req, size_t count) {
+    struct delayed *d = delay_new(req, DELAY_WRITE);
+    uint64_t now;
+
+    if (d == NULL) {
+        fuse_reply_write(req, count);
+        return;
+    }
+    now = delay_clock();
+    d->u.count = count;
+    d->due = delay_transfer(now, count) + delay_latency();
+    delay_hold(d, now);
+}
+
+static inline void delay_reply_entry(fuse_req_t req,
+const struct fuse_entry_param *e) {
+    struct delayed *d = delay_new(req, DELAY_ENTRY);
+    uint64_t now;
+
+    if (d == NULL) {
+        fuse_reply_entry(req, e);
+        return;
+    }
+    now = delay_clock();
+    d->u.entry.e = *e;
+    d->due = now + delay_latency();
+    delay_hold(d, now);
+}
+
+static inline void delay_reply_create(fuse_req_t req,
+const struct fuse_entry_param *e, const struct fuse_file_info *fi) {
+    struct delayed *d = delay_new(req, DELAY_CREATE);
+    uint64_t now;
+
+    if (d == NULL) {
+        fuse_reply_create(req, e, fi);
+        return;
+    }
+    now = delay_clock();
+    d->u.entry.e = *e;
+    d->u.entry.fi = *fi;
+    d->due = now + delay_latency();
+    delay_hold(d, now);
+}
+
+static inline void delay_reply_attr(fuse_req_t req,
+const struct stat *attr) {
+    struct delayed *d = delay_new(req, DELAY_ATTR);
+    uint64_t now;
+
+    if (d == NULL) {
+        fuse_reply_attr(req, attr, 1.0);
+        return;
+    }
+    now = delay_clock();
+    d->u.attr = *attr;
+    d->due = now + delay_latency();
+    delay_hold(d, now);
+}
+
+#endif /* _NULLFS_DELAY_H */
+
+/* vi:set sw=4 et tw=72: */
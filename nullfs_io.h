@@ -0,0 +1,154 @@
+/*
+    Data path shared by nullfs daemons.
+
+    Written data is discarded without being copied into the daemon:
+    with FUSE_CAP_SPLICE_READ libfuse leaves the payload of a write
+    request in a pipe spliced from /dev/fuse, and write_buf splices
+    it on into /dev/null. When the kernel or libfuse can't splice,
+    write_buf gets the payload in memory and just acknowledges it.
+
+    Reads of zero-filled files are answered from one read-only
+    anonymous mapping, which the kernel backs with its zero page:
+    reply's iovecs all point to it, so no buffer is allocated or
+    cleared per request.
+
+    With -o writeback the kernel caches writes in the page cache and
+    sends them on in large requests, so small appends (logs written
+    100 bytes at a time) cost one request per max_write bytes rather
+    than one per write(). Pages would then stay cached after their
+    writeback although the data is gone, so every written range is
+    queued for a drop thread, which invalidates it in the kernel's
+    cache right after the write is acknowledged. Notifications are
+    sent from that thread, never from a request handler, as the
+    kernel may wait on writeback of the same pages.
+*/
+
+#ifndef _NULLFS_IO_H
+#define _NULLFS_IO_H
+
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#define NULLFS_ZERO_SIZE (1 << 20)
+#define NULLFS_ZERO_IOV 16
+#define NULLFS_DROP_QUEUE 256
+
+static int nullfs_devnull = -1;
+static char *nullfs_zeroes = NULL;
+static int nullfs_writeback = 0;
+
+static const struct fuse_opt nullfs_io_opts[] = {
+    {"writeback", 0, 1},
+    FUSE_OPT_END
+};
+
+/* ranges waiting to be dropped from page cache */
+static struct nullfs_drop {
+    fuse_ino_t ino;
+    off_t off;
+    off_t len;
+} nullfs_drops[NULLFS_DROP_QUEUE];
+static unsigned nullfs_drop_head, nullfs_drop_tail;
+static pthread_mutex_t nullfs_drop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nullfs_drop_cond = PTHREAD_COND_INITIALIZER;
+
+static inline void *nullfs_drop_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&nullfs_drop_lock);
+    for (;;) {
+        struct nullfs_drop d;
+
+        while (nullfs_drop_head == nullfs_drop_tail)
+            pthread_cond_wait(&nullfs_drop_cond, &nullfs_drop_lock);
+        d = nullfs_drops[nullfs_drop_tail++ % NULLFS_DROP_QUEUE];
+        pthread_mutex_unlock(&nullfs_drop_lock);
+        if (ll_se != NULL)
+            fuse_lowlevel_notify_inval_inode(ll_se, d.ino, d.off,
+                d.len);
+        pthread_mutex_lock(&nullfs_drop_lock);
+    }
+    return NULL;
+}
+
+/* queues written range for dropping; a write continuing the last
+   queued range of the same file extends it. when the queue is full
+   the range is left to normal page reclaim */
+static inline void nullfs_drop(fuse_ino_t ino, off_t off, size_t len) {
+    struct nullfs_drop *last;
+
+    if (! nullfs_writeback || len == 0) return;
+    pthread_mutex_lock(&nullfs_drop_lock);
+    last = &nullfs_drops[(nullfs_drop_head - 1) % NULLFS_DROP_QUEUE];
+    if (nullfs_drop_head != nullfs_drop_tail && last->ino == ino
+    && last->off + last->len == off) {
+        last->len += len;
+    } else if (nullfs_drop_head - nullfs_drop_tail
+    < NULLFS_DROP_QUEUE) {
+        last = &nullfs_drops[nullfs_drop_head++ % NULLFS_DROP_QUEUE];
+        last->ino = ino;
+        last->off = off;
+        last->len = len;
+        pthread_cond_signal(&nullfs_drop_cond);
+    }
+    pthread_mutex_unlock(&nullfs_drop_lock);
+}
+
+/* called from init handler */
+static inline void nullfs_io_init(struct fuse_conn_info *conn) {
+    if (nullfs_devnull < 0)
+        nullfs_devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (nullfs_devnull >= 0 && (conn->capable & FUSE_CAP_SPLICE_READ))
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    if (nullfs_zeroes == NULL) {
+        void *p = mmap(NULL, NULLFS_ZERO_SIZE, PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) nullfs_zeroes = (char *) p;
+    }
+    if (nullfs_writeback
+    && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, nullfs_drop_thread, NULL) == 0) {
+            pthread_detach(t);
+            conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+        }
+    } else {
+        nullfs_writeback = 0;
+    }
+}
+
+/* consumes write payload; returns number of bytes written or -errno */
+static inline ssize_t nullfs_discard(struct fuse_bufvec *bufv) {
+    size_t size = fuse_buf_size(bufv);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+
+    if (! (bufv->buf[0].flags & FUSE_BUF_IS_FD) || nullfs_devnull < 0)
+        return size;
+    dst.buf[0].flags = FUSE_BUF_IS_FD;
+    dst.buf[0].fd = nullfs_devnull;
+    return fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags) 0);
+}
+
+/* replies to read with size zero bytes */
+static inline void nullfs_reply_zeroes(fuse_req_t req, size_t size) {
+    struct iovec iov[NULLFS_ZERO_IOV];
+    int n = 0;
+
+    if (nullfs_zeroes == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    while (size > 0 && n < NULLFS_ZERO_IOV) {
+        iov[n].iov_base = nullfs_zeroes;
+        iov[n].iov_len = (size < NULLFS_ZERO_SIZE) ? size : NULLFS_ZERO_SIZE;
+        size -= iov[n++].iov_len;
+    }
+    fuse_reply_iov(req, iov, n);
+}
+
+#endif /* _NULLFS_IO_H */
+
+/* vi:set sw=4 et tw=72: */
@@ -0,0 +1,407 @@
+/*
+    Path rules of nullfs daemons.
+
+    Rules given at mount time say what happens to paths matching a
+    glob, whatever the tree holds:
+
+      file     always exists as a file (created when looked up)
+      dir      always exists as a directory
+      enoent   never exists and can't be created
+      discard  writes are acknowledged and forgotten: file size
+               stays as it was and bytes aren't counted
+      count    writes are counted and grow the file, but it reads
+               back empty even with zero_fill or synth
+      pass     file data is kept in the backing directory (nullfs
+               with -o backing=DIR only, elsewhere same as no rule)
+
+    with "-o rule=ACTION:GLOB" (repeated) or "-o rules=FILE", a file
+    of "ACTION GLOB" lines where # starts a comment. First matching
+    rule wins. Globs match whole paths from the mount root: "*" and
+    "?" match within one component, "[a-z]" and "[!.]" are classes,
+    "**" matches across components, and "**" between two slashes
+    matches zero components too. A glob not starting with "/"
+    matches that name in any directory.
+
+    All globs are compiled into one DFA over byte classes, so a path
+    is classified in one pass whatever number of rules. The DFA runs
+    a component at a time: a daemon that keeps the state reached at
+    a directory only feeds "/" and the name for each lookup.
+*/
+
+#ifndef _NULLFS_RULES_H
+#define _NULLFS_RULES_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum rule_action { RULE_NONE = 0, RULE_FILE, RULE_DIR, RULE_ENOENT,
+    RULE_DISCARD, RULE_COUNT, RULE_PASS };
+
+static const char *const rule_names[] = {
+    "", "file", "dir", "enoent", "discard", "count", "pass"
+};
+
+#define RULES_MAX_POS 4096      /* glob positions of all rules */
+#define RULES_MAX_STATES 16384
+
+/* glob position: consumes a byte of set and moves on (or stays if
+   loop is set); eps are positions reached without consuming. last
+   position of a rule accepts, with rule = its index + 1 */
+struct rule_pos {
+    uint32_t set[8];
+    unsigned char loop;
+    short eps[2];
+    short rule;
+};
+
+static struct rule_pos rule_pos[RULES_MAX_POS];
+static int rule_npos = 0;
+static unsigned char rule_action[RULES_MAX_POS];   /* by rule index */
+static short rule_first[RULES_MAX_POS];            /* first position */
+static int rule_n = 0;
+
+/* compiled DFA; state 0 is dead, and is all there is with no rules */
+static struct {
+    unsigned char cls[256];
+    int nclasses;
+    unsigned nstates;
+    uint16_t *next;             /* nstates * nclasses */
+    unsigned char *accept;      /* rule_action of each state */
+    unsigned start;             /* state at the empty path */
+} rules = { {0}, 1, 1, NULL, NULL, 0 };
+
+static inline unsigned rules_step1(unsigned st, unsigned char c) {
+    return rules.next[st * rules.nclasses + rules.cls[c]];
+}
+
+static inline unsigned rules_step(unsigned st, const char *s,
+size_t len) {
+    const unsigned char *p = (const unsigned char *) s;
+
+    for (size_t i = 0; st != 0 && i < len; i++)
+        st = rules.next[st * rules.nclasses + rules.cls[p[i]]];
+    return st;
+}
+
+/* state of path dir/name given dir's state */
+static inline unsigned rules_child(unsigned st, const char *name,
+size_t len) {
+    return st ? rules_step(rules_step1(st, '/'), name, len) : 0;
+}
+
+static inline int rules_action(unsigned st) {
+    if (rules.accept == NULL) return RULE_NONE;
+    return rules.accept[st];
+}
+
+static inline struct rule_pos *rules_new_pos(void) {
+    struct rule_pos *p;
+
+    if (rule_npos == RULES_MAX_POS) return NULL;
+    p = &rule_pos[rule_npos++];
+    memset(p, 0, sizeof(*p));
+    p->eps[0] = p->eps[1] = -1;
+    return p;
+}
+
+static inline void rules_set(struct rule_pos *p, int c) {
+    p->set[c >> 5] |= 1U << (c & 31);
+}
+
+static inline void rules_set_all(struct rule_pos *p, int slash) {
+    for (int c = 0; c < 256; c++)
+        if (slash || c != '/') rules_set(p, c);
+}
+
+/* parses [...] class at *g, past the '[' */
+static inline const char *rules_class(struct rule_pos *p,
+const char *g) {
+    int neg = (*g == '!' || *g == '^');
+    uint32_t set[8] = {0};
+    int first = 1;
+
+    if (neg) g++;
+    for (; *g && (first || *g != ']'); first = 0) {
+        unsigned char lo = *g++, hi = lo;
+        if (*g == '-' && g[1] && g[1] != ']') {
+            hi = g[1];
+            g += 2;
+        }
+        for (int c = lo; c <= hi; c++) set[c >> 5] |= 1U << (c & 31);
+    }
+    if (*g != ']') return NULL;
+    for (int c = 0; c < 256; c++) {
+        int in = (set[c >> 5] >> (c & 31)) & 1;
+        if (in != neg && c != '/') rules_set(p, c);
+    }
+    return g + 1;
+}
+
+/* appends rule; returns 0 or -1 on a bad rule */
+static inline int rules_add(int action, const char *glob) {
+    const char *g = glob;
+    struct rule_pos *p;
+    int start = rule_npos;
+
+    if (action == RULE_NONE || rule_n == RULES_MAX_POS || *g == '\0')
+        return -1;
+    if (*g != '/') {
+        /* name in any directory */
+        char *any = (char *) malloc(strlen(glob) + 5);
+        int res;
+        if (any == NULL) return -1;
+        strcpy(any, "/**/");
+        strcat(any, glob);
+        res = rules_add(action, any);
+        free(any);
+        return res;
+    }
+    while (*g) {
+        if ((p = rules_new_pos()) == NULL) {
+            rule_npos = start;
+            return -1;
+        }
+        if (g[0] == '*' && g[1] == '*' && g[2] == '/') {
+            /* "**" then "/", or nothing */
+            int e = rule_npos - 1;
+            p->eps[0] = e + 1;
+            p->eps[1] = e + 3;
+            if ((p = rules_new_pos()) == NULL
+            || (p->loop = 1, p->eps[0] = e + 2, rules_set_all(p, 1),
+                p = rules_new_pos()) == NULL) {
+                rule_npos = start;
+                return -1;
+            }
+            rules_set(p, '/');
+            g += 3;
+        } else if (g[0] == '*') {
+            int all = (g[1] == '*');
+            rules_set_all(p, all);
+            p->loop = 1;
+            p->eps[0] = rule_npos;
+            g += all ? 2 : 1;
+        } else if (g[0] == '?') {
+            rules_set_all(p, 0);
+            g++;
+        } else if (g[0] == '[') {
+            if ((g = rules_class(p, g + 1)) == NULL) {
+                rule_npos = start;
+                return -1;
+            }
+        } else {
+            if (g[0] == '\\' && g[1]) g++;
+            rules_set(p, (unsigned char) *g++);
+        }
+    }
+    if ((p = rules_new_pos()) == NULL) {
+        rule_npos = start;
+        return -1;
+    }
+    p->rule = rule_n + 1;
+    rule_first[rule_n] = start;
+    rule_action[rule_n++] = action;
+    return 0;
+}
+
+/* parses "ACTION:GLOB" or "ACTION GLOB" */
+static inline int rules_add_spec(const char *spec) {
+    size_t n = strcspn(spec, ": \t");
+
+    for (int a = RULE_FILE; a <= RULE_PASS; a++) {
+        if (strlen(rule_names[a]) == n
+        && strncmp(spec, rule_names[a], n) == 0) {
+            spec += n;
+            spec += strspn(spec, ": \t");
+            return rules_add(a, spec);
+        }
+    }
+    return -1;
+}
+
+static inline int rules_load(const char *path) {
+    char line[4096];
+    FILE *f = fopen(path, "r");
+    int res = 0;
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (res == 0 && fgets(line, sizeof(line), f) != NULL) {
+        char *s = line + strspn(line, " \t");
+        s[strcspn(s, "#\r\n")] = '\0';
+        for (size_t n = strlen(s); n > 0 && (s[n - 1] == ' '
+        || s[n - 1] == '\t'); n--)
+            s[n - 1] = '\0';
+        if (*s == '\0') continue;
+        res = rules_add_spec(s);
+        if (res) fprintf(stderr, "%s: bad rule: %s\n", path, s);
+    }
+    fclose(f);
+    return res;
+}
+
+static inline void rules_closure(uint64_t *b) {
+    int again = 1;
+
+    while (again) {
+        again = 0;
+        for (int i = 0; i < rule_npos; i++) {
+            if (! ((b[i >> 6] >> (i & 63)) & 1)) continue;
+            for (int k = 0; k < 2; k++) {
+                int e = rule_pos[i].eps[k];
+                if (e >= 0 && ! ((b[e >> 6] >> (e & 63)) & 1)) {
+                    b[e >> 6] |= 1ULL << (e & 63);
+                    again = 1;
+                }
+            }
+        }
+    }
+}
+
+/* finds state with position set b or adds it as state *n; returns
+   its number, 0 when there's no room for another */
+static inline unsigned rules_state(uint64_t *sets, uint32_t *htab,
+size_t hsize, const uint64_t *b, size_t words, unsigned *n) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t slot;
+
+    for (size_t w = 0; w < words; w++)
+        h = (h ^ b[w]) * 0x100000001b3ULL;
+    for (slot = h % hsize; htab[slot]; slot = (slot + 1) % hsize)
+        if (memcmp(sets + htab[slot] * words, b, words * sizeof(*b))
+        == 0)
+            return htab[slot];
+    if (*n == RULES_MAX_STATES) return 0;
+    memcpy(sets + *n * words, b, words * sizeof(*b));
+    htab[slot] = *n;
+    return (*n)++;
+}
+
+/* subset construction. states are position bitsets, found again
+   through an open addressing table of their hashes */
+static inline int rules_compile(void) {
+    size_t words = (rule_npos + 63) / 64 + 1;
+    size_t hsize = 2 * RULES_MAX_STATES;
+    uint64_t *sets, *b;
+    uint32_t *htab;
+    unsigned n = 1, s;
+    int res = -1;
+
+    if (rule_n == 0) return 0;
+
+    /* byte classes: bytes no position tells apart */
+    memset(rules.cls, 0, sizeof(rules.cls));
+    rules.nclasses = 1;
+    for (int i = 0; i < rule_npos; i++) {
+        short map[256][2];
+        int nc = 0;
+        memset(map, 0xff, sizeof(map));
+        for (int c = 0; c < 256; c++) {
+            int in = (rule_pos[i].set[c >> 5] >> (c & 31)) & 1;
+            if (map[rules.cls[c]][in] < 0) map[rules.cls[c]][in] = nc++;
+            rules.cls[c] = map[rules.cls[c]][in];
+        }
+        rules.nclasses = nc;
+    }
+
+    sets = (uint64_t *) calloc(RULES_MAX_STATES, words * sizeof(*sets));
+    htab = (uint32_t *) calloc(hsize, sizeof(*htab));
+    rules.next = (uint16_t *) calloc(RULES_MAX_STATES * rules.nclasses,
+        sizeof(*rules.next));
+    rules.accept = (unsigned char *) calloc(RULES_MAX_STATES, 1);
+    b = (uint64_t *) malloc(words * sizeof(*b));
+    if (sets == NULL || htab == NULL || rules.next == NULL
+    || rules.accept == NULL || b == NULL)
+        goto RULES_COMPILE_OUT;
+
+    /* state 0: empty set, dead. state 1: start */
+    memset(b, 0, words * sizeof(*b));
+    for (int r = 0; r < rule_n; r++) {
+        int i = rule_first[r];
+        b[i >> 6] |= 1ULL << (i & 63);
+    }
+    rules_closure(b);
+    rules_state(sets, htab, hsize, b, words, &n);
+
+    for (s = 1; s < n; s++) {
+        uint64_t *cur = sets + s * words;
+        int best = 0;
+        for (int i = 0; i < rule_npos; i++)
+            if (((cur[i >> 6] >> (i & 63)) & 1) && rule_pos[i].rule
+            && (best == 0 || rule_pos[i].rule < best))
+                best = rule_pos[i].rule;
+        rules.accept[s] = RULE_NONE;
+        if (best) rules.accept[s] = rule_action[best - 1];
+
+        for (int c = 0; c < rules.nclasses; c++) {
+            int byte = 0, empty = 1;
+            unsigned to_st;
+            while (rules.cls[byte] != c) byte++;
+            memset(b, 0, words * sizeof(*b));
+            for (int i = 0; i < rule_npos; i++) {
+                int to;
+                if (! ((cur[i >> 6] >> (i & 63)) & 1)) continue;
+                if (! ((rule_pos[i].set[byte >> 5] >> (byte & 31)) & 1))
+                    continue;
+                to = rule_pos[i].loop ? i : i + 1;
+                b[to >> 6] |= 1ULL << (to & 63);
+                empty = 0;
+            }
+            if (empty) continue;    /* to dead state 0 */
+            rules_closure(b);
+            to_st = rules_state(sets, htab, hsize, b, words, &n);
+            if (to_st == 0) {
+                fprintf(stderr, "rules: too many DFA states\n");
+                goto RULES_COMPILE_OUT;
+            }
+            rules.next[s * rules.nclasses + c] = to_st;
+        }
+    }
+    rules.nstates = n;
+    rules.start = 1;
+    res = 0;
+
+RULES_COMPILE_OUT:
+    free(sets);
+    free(htab);
+    free(b);
+    if (res) {
+        free(rules.next);
+        free(rules.accept);
+        rules.next = NULL;
+        rules.accept = NULL;
+        rules.nclasses = 1;
+    }
+    return res;
+}
+
+/* fuse_opt handling of rule= and rules= */
+enum { RULES_KEY_RULE = 100, RULES_KEY_FILE };
+
+static const struct fuse_opt rules_opts[] = {
+    FUSE_OPT_KEY("rule=", RULES_KEY_RULE),
+    FUSE_OPT_KEY("rules=", RULES_KEY_FILE),
+    FUSE_OPT_END
+};
+
+static inline int rules_opt_proc(void *data, const char *arg, int key,
+struct fuse_args *outargs) {
+    (void) data;
+    (void) outargs;
+
+    if (key == RULES_KEY_RULE) {
+        if (rules_add_spec(arg + strlen("rule=")) == 0) return 0;
+        fprintf(stderr, "bad rule: %s\n", arg + strlen("rule="));
+        return -1;
+    }
+    if (key == RULES_KEY_FILE)
+        return rules_load(arg + strlen("rules=")) ? -1 : 0;
+    return 1;
+}
+
+#endif /* _NULLFS_RULES_H */
+
+/* vi:set sw=4 et tw=72: */
@@ -0,0 +1,353 @@
+/*
+    Per-operation statistics of nullfs daemons.
+
+    Handlers count themselves in a record owned by the calling
+    thread: number of calls, bytes moved and a histogram of handler
+    latency in power of 2 nanosecond buckets, for every op. Records
+    are cache line aligned and only their own thread writes to them,
+    with relaxed stores, so the hot path doesn't touch any shared
+    line. Records of all threads are summed up when the stats file is
+    opened. Record of an exited worker thread is kept and handed to
+    the next new one, so totals never go back.
+
+    The sum is exposed in the mount itself as read-only text file
+    /.nullfs/stats; read it twice and diff to get rates.
+*/
+
+#ifndef _NULLFS_STATS_H
+#define _NULLFS_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+enum stats_op {
+    STATS_LOOKUP, STATS_FORGET, STATS_GETATTR, STATS_SETATTR,
+    STATS_OPENDIR, STATS_READDIR, STATS_READDIRPLUS, STATS_RELEASEDIR,
+    STATS_OPEN, STATS_READ, STATS_WRITE, STATS_RELEASE, STATS_LSEEK,
+    STATS_CREATE, STATS_MKNOD, STATS_MKDIR, STATS_UNLINK, STATS_RMDIR,
+    STATS_RENAME, STATS_FSYNC, STATS_GETXATTR, STATS_LISTXATTR,
+    N_STATS_OPS
+};
+
+static const char *const stats_names[N_STATS_OPS] = {
+    "lookup", "forget", "getattr", "setattr",
+    "opendir", "readdir", "readdirplus", "releasedir",
+    "open", "read", "write", "release", "lseek",
+    "create", "mknod", "mkdir", "unlink", "rmdir",
+    "rename", "fsync", "getxattr", "listxattr"
+};
+
+/* bucket b counts latencies below 2^b ns, the last one the rest */
+#define STATS_BUCKETS 32
+
+struct stats_rec {
+    struct stats_rec *next;
+    int free;           /* owner thread exited */
+    uint64_t count[N_STATS_OPS];
+    uint64_t bytes[N_STATS_OPS];
+    uint64_t hist[N_STATS_OPS][STATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct stats_rec *stats_recs = NULL;
+static __thread struct stats_rec *stats_mine = NULL;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static struct timespec stats_start;
+
+/* names and inode numbers of the stats directory and file, for
+   daemons that don't keep them as nodes of their own */
+#define STATS_DIR_NAME ".nullfs"
+#define STATS_FILE_NAME "stats"
+#define STATS_DIR_INO ((fuse_ino_t) -2)
+#define STATS_FILE_INO ((fuse_ino_t) -3)
+
+static inline void stats_release_rec(void *p) {
+    __atomic_store_n(&((struct stats_rec *) p)->free, 1,
+        __ATOMIC_RELEASE);
+}
+
+static inline void stats_key_init(void) {
+    pthread_key_create(&stats_key, stats_release_rec);
+}
+
+/* called from init handler */
+static inline void nullfs_stats_init(void) {
+    clock_gettime(CLOCK_MONOTONIC, &stats_start);
+}
+
+/* calling thread's record: a free one, or a new one pushed on the
+   list; NULL if there's no memory */
+static inline struct stats_rec *stats_rec_get(void) {
+    struct stats_rec *r = stats_mine;
+
+    if (r != NULL) return r;
+    pthread_once(&stats_once, stats_key_init);
+    r = __atomic_load_n(&stats_recs, __ATOMIC_ACQUIRE);
+    for (; r != NULL; r = r->next) {
+        int one = 1;
+        if (__atomic_compare_exchange_n(&r->free, &one, 0, 0,
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (r == NULL) {
+        void *p;
+        if (posix_memalign(&p, 64, sizeof(*r)) != 0) return NULL;
+        r = (struct stats_rec *) p;
+        memset(r, 0, sizeof(*r));
+        r->next = __atomic_load_n(&stats_recs, __ATOMIC_RELAXED);
+        while (! __atomic_compare_exchange_n(&stats_recs, &r->next, r,
+        1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(stats_key, r);
+    stats_mine = r;
+    return r;
+}
+
+/* only the owner writes, so no atomic read-modify-write is needed;
+   relaxed store keeps readers from seeing torn values */
+static inline void stats_add(uint64_t *p, uint64_t n) {
+    __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_bytes(int op, uint64_t n) {
+    struct stats_rec *r = stats_rec_get();
+    if (r != NULL) stats_add(&r->bytes[op], n);
+}
+
+struct stats_timer {
+    int op;
+    struct timespec t0;
+};
+
+static inline struct stats_timer stats_begin(int op) {
+    struct stats_timer t;
+    t.op = op;
+    clock_gettime(CLOCK_MONOTONIC, &t.t0);
+    return t;
+}
+
+static inline void stats_end(struct stats_timer *t) {
+    struct stats_rec *r = stats_rec_get();
+    struct timespec t1;
+    uint64_t ns;
+    int b;
+
+    if (r == NULL) return;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (uint64_t) (t1.tv_sec - t->t0.tv_sec) * 1000000000
+        + t1.tv_nsec - t->t0.tv_nsec;
+    b = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (b >= STATS_BUCKETS) b = STATS_BUCKETS - 1;
+    stats_add(&r->count[t->op], 1);
+    stats_add(&r->hist[t->op][b], 1);
+}
+
+/* put at the top of a handler: counts the call and its latency when
+   handler returns, whichever way it does */
+#define STATS_OP(op) struct stats_timer stats_timer_ \
+    __attribute__((cleanup(stats_end))) = stats_begin(op)
+
+/* upper bound in ns of bucket holding q'th part of n calls */
+static inline uint64_t stats_quantile(const uint64_t *hist,
+uint64_t n, double q) {
+    uint64_t seen = 0;
+    int b;
+
+    for (b = 0; b < STATS_BUCKETS - 1; b++) {
+        seen += hist[b];
+        if (seen >= q * n) break;
+    }
+    return (uint64_t) 1 << b;
+}
+
+/* formats summed records as text; returns malloc'ed buffer or NULL */
+static inline char *stats_snapshot(size_t *len) {
+    static struct stats_rec sum;
+    static pthread_mutex_t sum_lock = PTHREAD_MUTEX_INITIALIZER;
+    struct stats_rec *r;
+    struct timespec now;
+    char *buf = NULL;
+    FILE *f;
+    int op, b;
+
+    f = open_memstream(&buf, len);
+    if (f == NULL) return NULL;
+    pthread_mutex_lock(&sum_lock);
+    memset(&sum, 0, sizeof(sum));
+    r = __atomic_load_n(&stats_recs, __ATOMIC_ACQUIRE);
+    for (; r != NULL; r = r->next) {
+        for (op = 0; op < N_STATS_OPS; op++) {
+            sum.count[op] += __atomic_load_n(&r->count[op],
+                __ATOMIC_RELAXED);
+            sum.bytes[op] += __atomic_load_n(&r->bytes[op],
+                __ATOMIC_RELAXED);
+            for (b = 0; b < STATS_BUCKETS; b++)
+                sum.hist[op][b] += __atomic_load_n(&r->hist[op][b],
+                    __ATOMIC_RELAXED);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(f, "uptime %.3f\n", (now.tv_sec - stats_start.tv_sec)
+        + (now.tv_nsec - stats_start.tv_nsec) * 1e-9);
+    fprintf(f, "%-12s %12s %16s %10s %10s\n", "op", "count", "bytes",
+        "p50_ns", "p99_ns");
+    for (op = 0; op < N_STATS_OPS; op++) {
+        if (sum.count[op] == 0) continue;
+        fprintf(f, "%-12s %12llu %16llu %10llu %10llu\n",
+            stats_names[op], (unsigned long long) sum.count[op],
+            (unsigned long long) sum.bytes[op],
+            (unsigned long long) stats_quantile(sum.hist[op],
+                sum.count[op], 0.5),
+            (unsigned long long) stats_quantile(sum.hist[op],
+                sum.count[op], 0.99));
+    }
+    /* histograms: "op ns:calls ..." for buckets below ns */
+    for (op = 0; op < N_STATS_OPS; op++) {
+        if (sum.count[op] == 0) continue;
+        fprintf(f, "hist %s", stats_names[op]);
+        for (b = 0; b < STATS_BUCKETS; b++)
+            if (sum.hist[op][b])
+                fprintf(f, " %llu:%llu", 1ULL << b,
+                    (unsigned long long) sum.hist[op][b]);
+        fputc('\n', f);
+    }
+    pthread_mutex_unlock(&sum_lock);
+
+    if (fclose(f) != 0) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* open file handle of the stats file: text taken at open, so reads
+   of one open file are consistent */
+struct stats_fh {
+    char *buf;
+    size_t len;
+};
+
+static inline void stats_open(fuse_req_t req,
+struct fuse_file_info *fi) {
+    struct stats_fh *fh;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    fh = (struct stats_fh *) malloc(sizeof(*fh));
+    if (fh == NULL || (fh->buf = stats_snapshot(&fh->len)) == NULL) {
+        free(fh);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    fi->fh = (uintptr_t) fh;
+    fi->direct_io = 1;      /* stat reports size 0 */
+    fuse_reply_open(req, fi);
+}
+
+static inline void stats_read(fuse_req_t req, size_t size, off_t off,
+struct fuse_file_info *fi) {
+    struct stats_fh *fh = (struct stats_fh *) (uintptr_t) fi->fh;
+
+    if ((size_t) off >= fh->len) size = 0;
+    else if (size > fh->len - off) size = fh->len - off;
+    fuse_reply_buf(req, fh->buf + off, size);
+}
+
+static inline void stats_release(fuse_req_t req,
+struct fuse_file_info *fi) {
+    struct stats_fh *fh = (struct stats_fh *) (uintptr_t) fi->fh;
+
+    free(fh->buf);
+    free(fh);
+    fuse_reply_err(req, 0);
+}
+
+static inline int stats_ino(fuse_ino_t ino) {
+    return ino == STATS_DIR_INO || ino == STATS_FILE_INO;
+}
+
+/* attributes of stats directory and file; returns 0 if ino is
+   neither */
+static inline int stats_stat(fuse_ino_t ino, struct stat *stbuf) {
+    if (! stats_ino(ino)) return 0;
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = ino;
+    if (ino == STATS_DIR_INO) {
+        stbuf->st_mode = S_IFDIR | 0555;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+    }
+    stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+    return 1;
+}
+
+/* looks up stats directory in root or the file in it; returns 1 if
+   e is filled, -ENOENT for other names in stats directory and 0 if
+   name is none of these */
+static inline int stats_lookup(fuse_ino_t parent, const char *name,
+struct fuse_entry_param *e) {
+    fuse_ino_t ino;
+
+    if (parent == FUSE_ROOT_ID && strcmp(name, STATS_DIR_NAME) == 0)
+        ino = STATS_DIR_INO;
+    else if (parent != STATS_DIR_INO)
+        return 0;
+    else if (strcmp(name, STATS_FILE_NAME) == 0)
+        ino = STATS_FILE_INO;
+    else
+        return -ENOENT;
+    memset(e, 0, sizeof(*e));
+    e->ino = ino;
+    e->attr_timeout = 1.0;
+    e->entry_timeout = 1.0;
+    stats_stat(ino, &e->attr);
+    return 1;
+}
+
+/* lists stats directory; with plus, the kernel takes a lookup
+   reference on "stats", which needs no forgetting */
+static inline void stats_readdir(fuse_req_t req, size_t size,
+off_t off, int plus) {
+    static const char *names[] = {".", "..", STATS_FILE_NAME};
+    static const fuse_ino_t inos[] = {STATS_DIR_INO, FUSE_ROOT_ID,
+        STATS_FILE_INO};
+    char buf[512];
+    size_t n = 0;
+
+    if (size > sizeof(buf)) size = sizeof(buf);
+    for (; off < 3; off++) {
+        struct fuse_entry_param e;
+        size_t len;
+        memset(&e, 0, sizeof(e));
+        e.ino = inos[off];
+        if (! stats_stat(e.ino, &e.attr)) {
+            e.attr.st_ino = e.ino;
+            e.attr.st_mode = S_IFDIR | 0777;
+        }
+        if (plus)
+            len = fuse_add_direntry_plus(req, buf + n, size - n,
+                names[off], &e, off + 1);
+        else
+            len = fuse_add_direntry(req, buf + n, size - n, names[off],
+                &e.attr, off + 1);
+        if (len > size - n) break;
+        n += len;
+    }
+    fuse_reply_buf(req, buf, n);
+}
+
+#endif /* _NULLFS_STATS_H */
+
+/* vi:set sw=4 et tw=72: */
@@ -0,0 +1,93 @@
+/*
+    Synthetic file content for nullfs "synth" read mode.
+
+    Content of a file at offset o depends only on file's seed and o,
+    so any range can be produced again without storing anything.
+    "random" fills every 32-bit word with murmur3's finalizer of its
+    index mixed with the seed; "pattern" fills every 64-bit word with
+    its own offset plus the seed, which a verifier can check without
+    running the generator. Words are stored in host byte order.
+
+    The generator works on 32-byte vectors (GCC vector extensions),
+    which the compiler maps to SSE2 or NEON as the target allows. On
+    x86-64 an AVX2 clone is picked at load time where the CPU has
+    it: SSE2 lacks 32-bit lane multiply, and the AVX2 clone runs
+    about four times as fast.
+*/
+
+#ifndef _NULLFS_SYNTH_H
+#define _NULLFS_SYNTH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+enum synth_mode { SYNTH_NONE = 0, SYNTH_RANDOM, SYNTH_PATTERN };
+
+#define SYNTH_VEC 32
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SYNTH_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define SYNTH_CLONES
+#endif
+
+typedef uint32_t synth_v32 __attribute__((vector_size(SYNTH_VEC)));
+typedef uint64_t synth_v64 __attribute__((vector_size(SYNTH_VEC)));
+
+static inline uint32_t synth_mix32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85ebca6bU;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35U;
+    return x ^ (x >> 16);
+}
+
+static inline uint64_t synth_seed(uint64_t ino) {
+    ino = (ino ^ (ino >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    ino = (ino ^ (ino >> 27)) * 0x94d049bb133111ebULL;
+    return ino ^ (ino >> 31);
+}
+
+/* fills n bytes at buf with content of file at offset off. n and off
+   must be multiples of SYNTH_VEC, buf is best aligned to it */
+SYNTH_CLONES static void synth_fill(char *buf, size_t n, uint64_t seed,
+uint64_t off, int mode) {
+    size_t i;
+
+    if (mode == SYNTH_PATTERN) {
+        synth_v64 v = {off, off + 8, off + 16, off + 24};
+        v += seed;
+        for (i = 0; i < n; i += SYNTH_VEC) {
+            memcpy(buf + i, &v, SYNTH_VEC);
+            v += SYNTH_VEC;
+        }
+        return;
+    }
+
+    /* 32-bit word index: low half counts in lanes, high half and
+       the seed make the key */
+    uint64_t w = off / 4;
+    uint32_t lo = (uint32_t) w;
+    synth_v32 v = {lo, lo + 1, lo + 2, lo + 3, lo + 4, lo + 5, lo + 6,
+        lo + 7};
+    synth_v32 k = {0};
+    for (i = 0; i < n; i += SYNTH_VEC, w += SYNTH_VEC / 4) {
+        if (i == 0 || (uint32_t) w == 0)
+            k = (synth_v32) {0} + ((uint32_t) seed
+                ^ synth_mix32((uint32_t) (seed >> 32)
+                ^ (uint32_t) (w >> 32)));
+        synth_v32 x = v ^ k;
+        x ^= x >> 16;
+        x *= 0x85ebca6bU;
+        x ^= x >> 13;
+        x *= 0xc2b2ae35U;
+        x ^= x >> 16;
+        memcpy(buf + i, &x, SYNTH_VEC);
+        v += SYNTH_VEC / 4;
+    }
+}
+
+#endif /* _NULLFS_SYNTH_H */
+
+/* vi:set sw=4 et tw=72: */
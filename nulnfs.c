@@ -7,8 +7,9 @@
 */
 
 #define _FILE_OFFSET_BITS 64
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 312
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -19,40 +20,262 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
-#include <fuse/fuse_lowlevel.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <fuse3/fuse_lowlevel.h>
 #include "linux_list.h"
+#include "ll_main.h"
+#include "nullfs_io.h"
+#include "nullfs_stats.h"
 
 time_t start_t;
 
 struct nulnfs_inode {
     struct stat st;
-    struct list_head r_ent;     /* list of referring dirents */
+    uint32_t r_off;             /* offset of referring dirent */
     struct list_head ls_ent;    /* list of child dirents */
+    uint64_t ls_hash;           /* child dirents hashed by name, map
+                                   offset of hlist_head table */
+    unsigned ls_hash_mask;      /* number of ls_hash buckets - 1 */
+    unsigned ls_count;          /* number of hashed child dirents */
+    unsigned long nlookup;      /* lookups the kernel holds */
+    struct list_head lru;       /* unreferenced leaf inodes */
+    struct list_head held;      /* inodes with nlookup != 0 */
     struct list_head free_ino;  /* free inodes */
 };
 
+/* one cache line per dirent. names of up to DIRENT_INLINE_NAME
+   bytes are stored in place, longer ones in the name arena; last
+   byte of d_name.inl is non-zero when d_name.ext (map offset) is
+   used. entry type is taken from inode's st_mode */
+#define DIRENT_INLINE_NAME 15
+
 struct nulnfs_dirent {
-    struct dirent de;
-    struct list_head ls_ent;    /* list of sibling dirents */
-    fuse_ino_t p_ino;           /* parent inode */
-    struct list_head free_ent;  /* free dirents */
+    struct list_head ls_ent;    /* sibling dirents, or free dirents */
+    struct hlist_node h_ent;    /* sibling dirents in hash bucket */
+    uint32_t d_ino;             /* inode, 0 when dirent is free */
+    uint32_t p_ino;             /* parent inode */
+    uint32_t d_hash;            /* hash of d_name */
+    uint32_t d_off;             /* index in dirent pool + 1 */
+    union {
+        char inl[DIRENT_INLINE_NAME + 1];
+        uint64_t ext;
+    } d_name;
+};
+
+/* long dirent names are carved from NAME_BLOCK sized arena blocks
+   in NAME_GRANULE steps; freed names are kept on free lists per
+   number of granules */
+#define NAME_GRANULE 16
+#define NAME_BLOCK 65536
+
+/* inodes and dirents live in pools which grow a chunk at a time up
+   to their limits; inode numbers and dirent offsets (index + 1)
+   are indexes into them */
+#define POOL_CHUNK_SHIFT 12
+#define POOL_CHUNK (1 << POOL_CHUNK_SHIFT)
+
+/* all metadata lives in one mapping: this superblock, the inode and
+   dirent pools, sized for their limits, and a heap that name arena
+   blocks and ls_hash tables are carved from. pages are only touched
+   as pools and heap grow. nothing in the map is a pointer: lists
+   link by relative offsets, the rest by pool index or by offset
+   from the start of the map, so the map works wherever it lands.
+
+   With -o image=FILE the map is a shared mapping of FILE, and a
+   restarted daemon picks the tree up by mapping it again. Only
+   lookups the old kernel session held (inodes on held_inodes) and
+   open directories' readdir cursors (on cursors) are dropped then,
+   the rest is used as it is. busy is set while a handler changes
+   pools, hashes or lists, so an image left by a daemon killed
+   halfway through an update is recognized and started over. That
+   holds because the page cache outlives the daemon; after a power
+   loss FILE has whatever pages were written back by then, busy
+   can't tell a torn image, and the tree may be inconsistent. */
+#define IMAGE_MAGIC "nulnfs\0\1"
+#define HEAP_CLASSES 32         /* free ls_hash tables by log2 size */
+#define HEAP_ALIGN 64
+
+struct nulnfs_super {
+    char magic[8];
+    uint32_t super_size;        /* record sizes of the build that */
+    uint32_t inode_size;        /* made the image */
+    uint32_t dirent_size;
+    int busy;                   /* update in progress */
+    uint32_t max_inodes;        /* pool limits */
+    uint32_t max_dirents;
+    uint32_t n_inodes;          /* inodes allocated so far */
+    uint32_t n_dirents;         /* dirents allocated so far */
+    uint64_t map_size;
+    uint64_t inodes;            /* map offsets of the pools */
+    uint64_t dirents;
+    uint64_t heap;              /* map offset of the heap */
+    uint64_t heap_size;
+    uint64_t heap_used;
+    uint64_t free_tables[HEAP_CLASSES];
+    uint64_t name_block;        /* arena block being carved */
+    uint64_t name_block_used;
+    uint64_t free_names[256 / NAME_GRANULE + 1];
+    uint64_t name_arena_size;   /* bytes of arena blocks */
+    struct list_head free_inodes;
+    struct list_head lru_inodes;    /* least recently used first */
+    struct list_head held_inodes;
+    struct list_head free_dirents;
+    struct hlist_head cursors;      /* of open directory handles */
 };
 
-struct nulnfs_inode *all_inodes = NULL;
-LIST_HEAD(free_inodes);
-struct nulnfs_dirent *all_dirents = NULL;
-LIST_HEAD(free_dirents);
+static char *map_base = NULL;
+static struct nulnfs_super *sb = NULL;
+static struct nulnfs_inode *inodes = NULL;
+static struct nulnfs_dirent *dirents = NULL;
 
 static struct fuse_lowlevel_ops nullfs_ll_ops;
 
-static char *mountpoint = NULL;
-int n_inodes = 65536;
-int n_dirents = 65536;
+/* pools, lists and hashes in the map are shared by all fuse worker
+   threads; handlers hold fs_lock while using them and reply after
+   releasing it */
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* pool sizes, set with -o inodes=N,max_inodes=N,dirents=N,...;
+   metadata image file and interval between flushes of it with
+   -o image=FILE,checkpoint=SEC (a flushed image is recent, not
+   necessarily consistent) */
+struct nulnfs_config {
+    unsigned inodes;            /* initial number of inodes */
+    unsigned max_inodes;
+    unsigned dirents;           /* initial number of dirents */
+    unsigned max_dirents;
+    char *image;
+    int checkpoint;             /* seconds between msync()s */
+};
+
+struct nulnfs_config conf = { POOL_CHUNK, 65536, POOL_CHUNK, 65536,
+    NULL, 0 };
+
+#define NULNFS_OPT(t, p) { t, offsetof(struct nulnfs_config, p), 1 }
+static const struct fuse_opt nulnfs_opts[] = {
+    NULNFS_OPT("inodes=%u", inodes),
+    NULNFS_OPT("max_inodes=%u", max_inodes),
+    NULNFS_OPT("dirents=%u", dirents),
+    NULNFS_OPT("max_dirents=%u", max_dirents),
+    NULNFS_OPT("image=%s", image),
+    NULNFS_OPT("checkpoint=%i", checkpoint),
+    FUSE_OPT_END
+};
+
+static void lock_fs(void) {
+    pthread_mutex_lock(&fs_lock);
+}
+
+/* called with fs_lock held before pools, hashes or lists are
+   changed; handlers which only look leave the superblock page
+   alone, so it isn't dirtied and written back for nothing */
+static void begin_update(void) {
+    if (sb->busy) return;
+    sb->busy = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static void unlock_fs(void) {
+    if (sb->busy) {
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        sb->busy = 0;
+    };
+    pthread_mutex_unlock(&fs_lock);
+}
+
+static void *map_ptr(uint64_t off) {
+    return map_base + off;
+}
+
+static uint64_t map_off(const void *p) {
+    return (const char *) p - map_base;
+}
+
+static struct nulnfs_inode *inode_at(fuse_ino_t ino) {
+    return &inodes[ino - 1];
+}
+
+static struct nulnfs_dirent *dirent_at(off_t off) {
+    return &dirents[off - 1];
+}
+
+/* carve size bytes from the heap, which is zeroed where it hasn't
+   been used yet; returns map offset or 0 when heap is used up */
+static uint64_t heap_alloc(size_t size) {
+    uint64_t off = (sb->heap_used + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+
+    if (off + size > sb->heap_size) return 0;
+    sb->heap_used = off + size;
+    return sb->heap + off;
+}
+
+/* zeroed ls_hash table of size (a power of 2) bytes, a freed one
+   of the same size if there is one; returns map offset or 0 */
+static uint64_t alloc_table(size_t size) {
+    uint64_t *f = &sb->free_tables[__builtin_ctzl(size)];
+    uint64_t off = *f;
+
+    if (off == 0) return heap_alloc(size);
+    *f = *(uint64_t *) map_ptr(off);
+    memset(map_ptr(off), 0, size);
+    return off;
+}
+
+static void free_table(uint64_t off, size_t size) {
+    uint64_t *f = &sb->free_tables[__builtin_ctzl(size)];
+
+    *(uint64_t *) map_ptr(off) = *f;
+    *f = off;
+}
+
+/* add a chunk of inodes to free_inodes; returns 0 if max_inodes
+   are already allocated */
+static int grow_inodes(void) {
+    struct nulnfs_inode *chunk;
+    int i;
+
+    if (sb->n_inodes >= sb->max_inodes) return 0;
+    chunk = inode_at(sb->n_inodes + 1);
+    for (i = 0; i < POOL_CHUNK; i++) {
+        chunk[i].st.st_ino = sb->n_inodes + i + 1;
+        chunk[i].ls_hash = 0;
+        chunk[i].nlookup = 0;
+        chunk[i].r_off = 0;
+        INIT_LIST_HEAD(&(chunk[i].lru));
+        INIT_LIST_HEAD(&(chunk[i].held));
+        INIT_LIST_HEAD(&(chunk[i].ls_ent));
+        INIT_LIST_HEAD(&(chunk[i].free_ino));
+        list_add_tail(&(chunk[i].free_ino), &sb->free_inodes);
+    };
+    sb->n_inodes += POOL_CHUNK;
+    return 1;
+}
+
+/* add a chunk of dirents to free_dirents; returns 0 if max_dirents
+   are already allocated */
+static int grow_dirents(void) {
+    struct nulnfs_dirent *chunk;
+    int e;
+
+    if (sb->n_dirents >= sb->max_dirents) return 0;
+    chunk = dirent_at(sb->n_dirents + 1);
+    for (e = 0; e < POOL_CHUNK; e++) {
+        chunk[e].d_off = sb->n_dirents + e + 1;
+        chunk[e].d_ino = 0;     /* free */
+        chunk[e].p_ino = 0;     /* no parent yet */
+        INIT_HLIST_NODE(&(chunk[e].h_ent));
+        list_add_tail(&(chunk[e].ls_ent), &sb->free_dirents);
+    };
+    sb->n_dirents += POOL_CHUNK;
+    return 1;
+}
 
-/*
 static void nullfs_mkstat(struct stat *pstat, fuse_req_t req,
 fuse_ino_t i, mode_t m) {
     const struct fuse_ctx *c = fuse_req_ctx(req);
+    memset(pstat, 0, sizeof(struct stat));
     pstat->st_ino = i;
     if (c != NULL) {
         pstat->st_uid = c->uid;
@@ -68,6 +291,7 @@ fuse_ino_t i, mode_t m) {
     pstat->st_atime = pstat->st_mtime;
 }
 
+/*
 static void nullfs_mkdirstat(struct stat *pstat, fuse_req_t req,
 fuse_ino_t i, mode_t m) {
     nullfs_mkstat(pstat, req, i, m);
@@ -76,61 +300,242 @@ fuse_ino_t i, mode_t m) {
 }
 */
 
+/* FNV-1a hash of dirent name */
+static unsigned name_hash(const char *name) {
+    unsigned h = 2166136261u;
+    while (*name) h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h;
+}
+
+/* double dirnode's ls_hash table. when there's no memory for a
+   bigger one, keep the old table, just with longer chains */
+static struct hlist_head *ls_hash(const struct nulnfs_inode *pinode) {
+    return map_ptr(pinode->ls_hash);
+}
+
+static void grow_ls_hash(struct nulnfs_inode *pinode) {
+    unsigned mask = pinode->ls_hash ? pinode->ls_hash_mask * 2 + 1 : 7;
+    uint64_t off = alloc_table((mask + 1) * sizeof(struct hlist_head));
+    struct hlist_head *ht = map_ptr(off);
+    struct nulnfs_dirent *c;
+    struct hlist_node *pos, *n;
+    unsigned i;
+
+    if (off == 0) return;
+    for (i = 0; pinode->ls_hash != 0 && i <= pinode->ls_hash_mask;
+    i++) {
+        hlist_for_each_entry_safe(c, pos, n, &ls_hash(pinode)[i], h_ent)
+            hlist_add_head(&c->h_ent, &ht[c->d_hash & mask]);
+    };
+    if (pinode->ls_hash != 0)
+        free_table(pinode->ls_hash,
+            (pinode->ls_hash_mask + 1) * sizeof(struct hlist_head));
+    pinode->ls_hash = off;
+    pinode->ls_hash_mask = mask;
+}
+
+/* copy name of len bytes to the name arena */
+static char *alloc_name(const char *name, size_t len) {
+    size_t g = (len + NAME_GRANULE) / NAME_GRANULE;
+    char *p;
+
+    if (sb->free_names[g] != 0) {
+        p = map_ptr(sb->free_names[g]);
+        sb->free_names[g] = *(uint64_t *) p;
+    } else {
+        if (sb->name_block_used + g * NAME_GRANULE > NAME_BLOCK) {
+            uint64_t b = heap_alloc(NAME_BLOCK);
+            if (b == 0) return NULL;
+            sb->name_block = b;
+            sb->name_block_used = 0;
+            sb->name_arena_size += NAME_BLOCK;
+        };
+        p = map_ptr(sb->name_block + sb->name_block_used);
+        sb->name_block_used += g * NAME_GRANULE;
+    };
+    memcpy(p, name, len + 1);
+    return p;
+}
+
+/* return name to the name arena's free list */
+static void free_name(char *p) {
+    size_t g = (strlen(p) + NAME_GRANULE) / NAME_GRANULE;
+    *(uint64_t *) p = sb->free_names[g];
+    sb->free_names[g] = map_off(p);
+}
+
+static const char *dirent_name(const struct nulnfs_dirent *pdirent) {
+    if (pdirent->d_name.inl[DIRENT_INLINE_NAME])
+        return map_ptr(pdirent->d_name.ext);
+    return pdirent->d_name.inl;
+}
+
+/* find dirent by name in dirnode's ls_hash */
+static struct nulnfs_dirent *find_dirent(
+const struct nulnfs_inode *pinode, const char *name) {
+    unsigned h = name_hash(name);
+    struct nulnfs_dirent *c;
+    struct hlist_node *pos;
+
+    if (pinode->ls_hash == 0) return NULL;
+    hlist_for_each_entry(c, pos,
+    &ls_hash(pinode)[h & pinode->ls_hash_mask], h_ent) {
+        if (c->d_hash == h && strcmp(dirent_name(c), name) == 0)
+            return c;
+    };
+    return NULL;
+}
+
+/* remove dirent from its dirnode's ls_ent list and ls_hash */
+static void detach_dirent(struct nulnfs_dirent *pdirent) {
+    if (! hlist_unhashed(&pdirent->h_ent)) {
+        hlist_del_init(&pdirent->h_ent);
+        inode_at(pdirent->p_ino)->ls_count--;
+    };
+    list_del_init(&pdirent->ls_ent);
+}
+
 /* remove dirent from dirnode's ls_ent list and return to
-   filesystem's free_ent list. don't change st_nlink */
+   filesystem's free_dirents list. don't change st_nlink */
 static int free_dirent(struct nulnfs_dirent *pdirent) {
-    list_del_init(&pdirent->ls_ent);    /* remove from old dir */
-    if (list_empty(&pdirent->free_ent))
-        list_add_tail(&pdirent->free_ent, &free_dirents);
+    if (pdirent->d_ino == 0) return 0;  /* already free */
+    detach_dirent(pdirent);             /* remove from old dir */
+    if (pdirent->d_name.inl[DIRENT_INLINE_NAME])
+        free_name(map_ptr(pdirent->d_name.ext));
+    pdirent->d_ino = 0;
+    list_add_tail(&pdirent->ls_ent, &sb->free_dirents);
     return 0;   /* TODO: error reporting */
 }
 
-/* remove dirent from filesystem's free_ent list and append
-   to dirnode's ls_ent list. don't change st_nlink */
+/* move dirent to dirnode's ls_ent list (dirent allocated by
+   alloc_dirent is off free_dirents already). don't change st_nlink */
 static int insert_dirent_into_dirnode(struct nulnfs_dirent *pdirent,
 struct nulnfs_inode *pinode) {
     if (! S_ISDIR(pinode->st.st_mode)) return ENOTDIR;
-    list_del_init(&pdirent->ls_ent);    /* remove from old dir */
-    list_del_init(&pdirent->free_ent);  /* remove from free dirents */
+    if (pinode->ls_count >= pinode->ls_hash_mask) grow_ls_hash(pinode);
+    if (pinode->ls_hash == 0) return ENOMEM;
+    detach_dirent(pdirent);             /* remove from old dir */
     list_add_tail(&pdirent->ls_ent, &pinode->ls_ent);
-    return 0;   /* TODO: report ls_ent/free_ent collisions */
+    pdirent->p_ino = pinode->st.st_ino;
+    hlist_add_head(&pdirent->h_ent,
+        &ls_hash(pinode)[pdirent->d_hash & pinode->ls_hash_mask]);
+    pinode->ls_count++;
+    return 0;
+}
+
+/* directory is a leaf when it holds only "." and ".." */
+static int is_leaf(const struct nulnfs_inode *pinode) {
+    return (! S_ISDIR(pinode->st.st_mode) || pinode->ls_count <= 2);
+}
+
+/* put inode at the tail of lru_inodes when the kernel doesn't
+   reference it and it can be forgotten, take it off otherwise.
+   inodes the kernel references are kept on held_inodes */
+static void update_lru(struct nulnfs_inode *pinode) {
+    if (pinode->nlookup == 0) list_del_init(&pinode->held);
+    else if (list_empty(&pinode->held))
+        list_add(&pinode->held, &sb->held_inodes);
+    if (pinode->nlookup == 0 && pinode->st.st_ino != FUSE_ROOT_ID
+    && pinode->st.st_nlink != 0 && is_leaf(pinode)) {
+        if (list_empty(&pinode->lru))
+            list_add_tail(&pinode->lru, &sb->lru_inodes);
+    } else {
+        list_del_init(&pinode->lru);
+    };
+}
+
+/* remove inode's name dirent from its parent directory */
+static void unlink_dirent(struct nulnfs_dirent *pdirent) {
+    struct nulnfs_inode *dinode = inode_at(pdirent->p_ino);
+    struct nulnfs_inode *pinode = inode_at(pdirent->d_ino);
+    if (S_ISDIR(pinode->st.st_mode)) dinode->st.st_nlink--;
+    pinode->r_off = 0;
+    free_dirent(pdirent);
+    update_lru(dinode);
+}
+
+/* free dirnode's "." and ".." and detach readdir cursors of its
+   open handles, which are told apart by d_ino 0 */
+static void clear_dirnode(struct nulnfs_inode *pinode) {
+    while (! list_empty(&pinode->ls_ent)) {
+        struct nulnfs_dirent *pdirent = list_first_entry(
+            &pinode->ls_ent, struct nulnfs_dirent, ls_ent);
+        if (pdirent->d_ino == 0) list_del_init(&pdirent->ls_ent);
+        else free_dirent(pdirent);
+    };
+}
+
+/* return leaf inode, its name in parent directory and, for
+   directories, its "." and ".." to free lists */
+static void free_inode(struct nulnfs_inode *pinode) {
+    if (pinode->r_off != 0) unlink_dirent(dirent_at(pinode->r_off));
+    clear_dirnode(pinode);
+    list_del_init(&pinode->lru);
+    list_del_init(&pinode->held);
+    pinode->nlookup = 0;
+    pinode->st.st_mode = 0;
+    pinode->st.st_nlink = 0;
+    if (list_empty(&pinode->free_ino))
+        list_add_tail(&pinode->free_ino, &sb->free_inodes);
+}
+
+/* forget least recently used leaf inode to make room for new
+   inodes and dirents when pools can't grow anymore; returns 0 if
+   there's nothing to forget */
+static int reclaim_lru(void) {
+    if (list_empty(&sb->lru_inodes)) return 0;
+    free_inode(list_first_entry(&sb->lru_inodes, struct nulnfs_inode,
+        lru));
+    return 1;
 }
 
-/* allocate dirent from filesystem's free_ent list */
+/* get inode from filesystem's free_ino list without removing it */
+static struct nulnfs_inode *alloc_inode(void) {
+    if (list_empty(&sb->free_inodes) && ! grow_inodes()
+    && ! reclaim_lru())
+        return NULL;
+    return list_first_entry(&sb->free_inodes, struct nulnfs_inode,
+        free_ino);
+}
+
+/* allocate dirent from filesystem's free_dirents list */
 static struct nulnfs_dirent *alloc_dirent(const char *name,
-ino_t ino, ino_t p_ino, unsigned char d_type) {
+ino_t ino, ino_t p_ino) {
     struct nulnfs_dirent *dirent;
-    if (list_empty(&free_dirents)) {
+    size_t len = strlen(name);
+    if (list_empty(&sb->free_dirents) && ! grow_dirents()
+    && ! reclaim_lru()) {
         fprintf(stderr, "ERROR alloc_dirent \"%s\":"
             " no more free dirents\n", name);
         return NULL;
     };
-    dirent = list_entry(free_dirents.next, struct nulnfs_dirent,
-        free_ent);
-    fprintf(stderr, "DEBUG alloc_dirent \"%s\":\ndirent=%p\n"
-        "all_dirents=%p\n&free_dirents=%p\nfree_dirents.next=%p\n"
-        "free_dirents.prev=%p\n&all_dirents->ls_ent=%p\n"
-        "&all_dirents->free_ent=%p\n", name, dirent, all_dirents,
-        &free_dirents, free_dirents.next, free_dirents.prev,
-        &all_dirents->ls_ent, &all_dirents->free_ent);
-    if (dirent->de.d_off != dirent - all_dirents + 1) {
-        fprintf(stderr, "ERROR alloc_dirent \"%s\": #%i, off %i\n",
-            name, (int)(dirent - all_dirents + 1), dirent->de.d_off);
+    dirent = list_first_entry(&sb->free_dirents, struct nulnfs_dirent,
+        ls_ent);
+    if (dirent_at(dirent->d_off) != dirent) {
+        fprintf(stderr, "ERROR alloc_dirent \"%s\": off %u\n",
+            name, dirent->d_off);
         return NULL;
     };
-    list_del_init(&dirent->free_ent);
-    dirent->de.d_ino = ino;
-    dirent->de.d_type = d_type;
-    dirent->de.d_reclen = 0;     /* XXX */
+    if (len > DIRENT_INLINE_NAME) {
+        char *ext = alloc_name(name, len);
+        if (ext == NULL) return NULL;
+        dirent->d_name.ext = map_off(ext);
+        dirent->d_name.inl[DIRENT_INLINE_NAME] = 1;
+    } else {
+        memset(dirent->d_name.inl, 0, sizeof(dirent->d_name.inl));
+        memcpy(dirent->d_name.inl, name, len);
+    };
+    list_del_init(&dirent->ls_ent);
+    dirent->d_ino = ino;
     dirent->p_ino = p_ino;
-    strncpy(dirent->de.d_name, name, sizeof(dirent->de.d_name));
-    dirent->de.d_name[255] = '\0';
+    dirent->d_hash = name_hash(name);
     return dirent;
 }
 
 static int init_dirnode(struct nulnfs_inode *pinode,
 fuse_ino_t i, fuse_ino_t parent_ino, uid_t u, gid_t g, mode_t m) {
     struct nulnfs_dirent *p_d_ent, *p_dd_ent;
+    memset(&pinode->st, 0, sizeof(struct stat));
     pinode->st.st_ino = i;
     pinode->st.st_uid = u;
     pinode->st.st_gid = g;
@@ -139,23 +544,36 @@ fuse_ino_t i, fuse_ino_t parent_ino, uid_t u, gid_t g, mode_t m) {
     pinode->st.st_mtime = time(NULL);
     pinode->st.st_ctime = pinode->st.st_mtime;
     pinode->st.st_atime = pinode->st.st_mtime;
-    INIT_LIST_HEAD(&pinode->r_ent);
+    pinode->r_off = 0;
     INIT_LIST_HEAD(&pinode->ls_ent);
+    pinode->ls_count = 0;
+    if (pinode->ls_hash == 0) grow_ls_hash(pinode);
+    if (pinode->ls_hash == 0) return 0;
     list_del_init(&pinode->free_ino);
-    p_d_ent = alloc_dirent(".", i, i, DT_DIR);
+    p_d_ent = alloc_dirent(".", i, i);
     if (p_d_ent == NULL) goto INIT_DIRNODE_ERR1;
-    p_dd_ent = alloc_dirent("..", i, parent_ino ? parent_ino : i, DT_DIR);
+    p_dd_ent = alloc_dirent("..", parent_ino ? parent_ino : i, i);
     if (p_dd_ent == NULL) goto INIT_DIRNODE_ERR2;
     insert_dirent_into_dirnode(p_d_ent, pinode);
     insert_dirent_into_dirnode(p_dd_ent, pinode);
     return 1;
 INIT_DIRNODE_ERR2:
-    list_add(&p_dd_ent->free_ent, &free_dirents);
+    free_dirent(p_d_ent);
 INIT_DIRNODE_ERR1:
-    list_add(&pinode->free_ino, &free_inodes);
+    list_add(&pinode->free_ino, &sb->free_inodes);
     return 0;
 }
 
+/* fill in entry param for lookup, create and readdirplus replies */
+static void fill_entry(struct fuse_entry_param *e,
+const struct nulnfs_inode *pinode) {
+    memset(e, 0, sizeof(*e));
+    e->ino = pinode->st.st_ino;
+    e->attr_timeout = 1.0;
+    e->entry_timeout = 1.0;
+    memcpy(&e->attr, &pinode->st, sizeof(struct stat));
+}
+
 /* returns pointer to basename part of pathname */
 const char *bnamepos(const char *name) {
     const char *p_slash;
@@ -166,30 +584,416 @@ const char *bnamepos(const char *name) {
 
 static void nullfs_ll_lookup(fuse_req_t req,
 fuse_ino_t par_ino, const char *name) {
+    STATS_OP(STATS_LOOKUP);
     struct fuse_entry_param e;
     const struct nulnfs_dirent *de = NULL;
-    const struct nulnfs_dirent *c;
-    const char *bname = bnamepos(name);
+    int res = stats_lookup(par_ino, name, &e);
 
-    if (par_ino < 1 || par_ino > n_inodes) fuse_reply_err(req, ENOENT);
+    if (res > 0) {
+        fuse_reply_entry(req, &e);
+        return;
+    };
+    lock_fs();
+    if (par_ino >= 1 && par_ino <= sb->n_inodes)
+        de = find_dirent(inode_at(par_ino), bnamepos(name));
+    if (de != NULL) {
+        /* first reference moves inode from lru to held_inodes */
+        if (inode_at(de->d_ino)->nlookup++ == 0) begin_update();
+        update_lru(inode_at(de->d_ino));
+        fill_entry(&e, inode_at(de->d_ino));
+    };
+    unlock_fs();
+
+    if (de == NULL) fuse_reply_err(req, ENOENT);
+    else fuse_reply_entry(req, &e);
+}
 
-    __list_for_each_entry (c, &all_inodes[par_ino - 1].ls_ent, ls_ent) {
-        if (0 == strcmp(bname, c->de.d_name)) {
-            de = c;
-            break;
+/* create inode of mode m named name in directory par_ino and fill
+   in its entry param; returns 0 or errno */
+static int make_node(fuse_req_t req, fuse_ino_t par_ino,
+const char *name, mode_t m, struct fuse_entry_param *e) {
+    struct nulnfs_inode *dinode, *pinode;
+    struct nulnfs_dirent *pdirent;
+    const struct fuse_ctx *c;
+    fuse_ino_t ino;
+    int err;
+
+    if (par_ino < 1 || par_ino > sb->n_inodes) return ENOENT;
+    dinode = inode_at(par_ino);
+    if (! S_ISDIR(dinode->st.st_mode)) return ENOTDIR;
+    if (strlen(name) > 255) return ENAMETOOLONG;
+    if (find_dirent(dinode, name) != NULL) return EEXIST;
+    if (par_ino == 1 && strcmp(name, STATS_DIR_NAME) == 0)
+        return EEXIST;     /* taken by stats */
+
+    /* pin parent: allocations below may forget lru inodes */
+    dinode->nlookup++;
+    update_lru(dinode);
+    err = ENOSPC;
+    pinode = alloc_inode();
+    if (pinode == NULL) goto MAKE_NODE_OUT;
+    ino = pinode->st.st_ino;
+    pdirent = alloc_dirent(name, ino, par_ino);
+    if (pdirent == NULL) goto MAKE_NODE_OUT;
+    if (S_ISDIR(m)) {
+        c = fuse_req_ctx(req);
+        if (! init_dirnode(pinode, ino, par_ino, c ? c->uid : 0,
+        c ? c->gid : 0, m)) {
+            free_dirent(pdirent);
+            goto MAKE_NODE_OUT;
         };
+    } else {
+        list_del_init(&pinode->free_ino);
+        nullfs_mkstat(&pinode->st, req, ino, m);
     };
+    err = insert_dirent_into_dirnode(pdirent, dinode);
+    if (err) {
+        free_dirent(pdirent);
+        free_inode(pinode);
+        goto MAKE_NODE_OUT;
+    };
+    pinode->r_off = pdirent->d_off;
+    if (S_ISDIR(m)) dinode->st.st_nlink++;
+    pinode->nlookup = 1;
+    update_lru(pinode);
+    fill_entry(e, pinode);
+MAKE_NODE_OUT:
+    dinode->nlookup--;
+    update_lru(dinode);
+    return err;
+}
 
-    if (de != NULL) {
-        e.ino = de->de.d_ino;
-        e.attr_timeout = 1.0;
-        e.entry_timeout = 1.0;
-        memcpy(&e.attr, &all_inodes[de->de.d_ino].st,
-            sizeof(struct stat));
-        fuse_reply_entry(req, &e);
+/* remove name from directory par_ino. the inode itself is freed
+   right away unless the kernel still references it, in which case
+   forget frees it; returns 0 or errno */
+static int remove_node(fuse_ino_t par_ino, const char *name, int dir) {
+    struct nulnfs_inode *dinode, *pinode;
+    struct nulnfs_dirent *pdirent;
+
+    if (par_ino < 1 || par_ino > sb->n_inodes) return ENOENT;
+    dinode = inode_at(par_ino);
+    if (! S_ISDIR(dinode->st.st_mode)) return ENOTDIR;
+    if (strcmp(name, ".") == 0) return EINVAL;
+    if (strcmp(name, "..") == 0) return ENOTEMPTY;
+    pdirent = find_dirent(dinode, name);
+    if (pdirent == NULL) return ENOENT;
+    pinode = inode_at(pdirent->d_ino);
+    if (dir && ! S_ISDIR(pinode->st.st_mode)) return ENOTDIR;
+    if (! dir && S_ISDIR(pinode->st.st_mode)) return EISDIR;
+    if (! is_leaf(pinode)) return ENOTEMPTY;
+
+    unlink_dirent(pdirent);
+    clear_dirnode(pinode);
+    pinode->st.st_nlink = 0;
+    if (pinode->nlookup == 0) free_inode(pinode);
+    else update_lru(pinode);
+    return 0;
+}
+
+/* drop nlookup kernel references to inode */
+static void forget_inode(fuse_ino_t ino, uint64_t nlookup) {
+    struct nulnfs_inode *pinode;
+
+    if (ino < 1 || ino > sb->n_inodes) return;
+    pinode = inode_at(ino);
+    pinode->nlookup -= (nlookup < pinode->nlookup) ? nlookup
+        : pinode->nlookup;
+    if (pinode->nlookup == 0 && pinode->st.st_nlink == 0
+    && pinode->st.st_mode != 0) {
+        free_inode(pinode);     /* unlinked while looked up */
+    } else {
+        update_lru(pinode);
     };
 }
 
+/**
+ * Create file node
+ *
+ * Create a regular file, character device, block device, fifo or
+ * socket node.
+ *
+ * Valid replies:
+ *   fuse_reply_entry
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param parent inode number of the parent directory
+ * @param name to create
+ * @param mode file type and mode with which to create the new file
+ * @param rdev the device number (only valid if created file is a device)
+ */
+static void nullfs_ll_mknod(fuse_req_t req, fuse_ino_t parent,
+const char *name, mode_t mode, dev_t rdev) {
+    STATS_OP(STATS_MKNOD);
+    struct fuse_entry_param e;
+    int err;
+    (void) rdev;
+
+    lock_fs();
+    begin_update();
+    err = make_node(req, parent, name, mode, &e);
+    unlock_fs();
+    if (err) fuse_reply_err(req, err);
+    else fuse_reply_entry(req, &e);
+}
+
+/**
+ * Create a directory
+ *
+ * Valid replies:
+ *   fuse_reply_entry
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param parent inode number of the parent directory
+ * @param name to create
+ * @param mode with which to create the new file
+ */
+static void nullfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent,
+const char *name, mode_t mode) {
+    STATS_OP(STATS_MKDIR);
+    struct fuse_entry_param e;
+    int err;
+
+    lock_fs();
+    begin_update();
+    err = make_node(req, parent, name, S_IFDIR | (mode & ~S_IFMT), &e);
+    unlock_fs();
+    if (err) fuse_reply_err(req, err);
+    else fuse_reply_entry(req, &e);
+}
+
+/**
+ * Create and open a file
+ *
+ * If the file does not exist, first create it with the specified
+ * mode, and then open it.
+ *
+ * Valid replies:
+ *   fuse_reply_create
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param parent inode number of the parent directory
+ * @param name to create
+ * @param mode file type and mode with which to create the new file
+ * @param fi file information
+ */
+static void nullfs_ll_create(fuse_req_t req, fuse_ino_t parent,
+const char *name, mode_t mode, struct fuse_file_info *fi) {
+    STATS_OP(STATS_CREATE);
+    struct fuse_entry_param e;
+    int err;
+
+    lock_fs();
+    begin_update();
+    err = make_node(req, parent, name, S_IFREG | (mode & ~S_IFMT), &e);
+    unlock_fs();
+    if (err) fuse_reply_err(req, err);
+    else fuse_reply_create(req, &e, fi);
+}
+
+/**
+ * Remove a file
+ *
+ * Valid replies:
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param parent inode number of the parent directory
+ * @param name to remove
+ */
+static void nullfs_ll_unlink(fuse_req_t req, fuse_ino_t parent,
+const char *name) {
+    STATS_OP(STATS_UNLINK);
+    int err;
+
+    lock_fs();
+    begin_update();
+    err = remove_node(parent, name, 0);
+    unlock_fs();
+    fuse_reply_err(req, err);
+}
+
+/**
+ * Remove a directory
+ *
+ * Valid replies:
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param parent inode number of the parent directory
+ * @param name to remove
+ */
+static void nullfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent,
+const char *name) {
+    STATS_OP(STATS_RMDIR);
+    int err;
+
+    lock_fs();
+    begin_update();
+    err = remove_node(parent, name, 1);
+    unlock_fs();
+    fuse_reply_err(req, err);
+}
+
+/**
+ * Forget about an inode
+ *
+ * The nlookup parameter indicates the number of lookups
+ * previously performed on this inode.
+ *
+ * If the filesystem implements inode lifetimes, it is recommended
+ * that inodes acquire a single reference on each lookup, and lose
+ * nlookup references on each forget.
+ *
+ * Valid replies:
+ *   fuse_reply_none
+ *
+ * @param req request handle
+ * @param ino the inode number
+ * @param nlookup the number of lookups to forget
+ */
+static void nullfs_ll_forget(fuse_req_t req, fuse_ino_t ino,
+uint64_t nlookup) {
+    STATS_OP(STATS_FORGET);
+    lock_fs();
+    begin_update();
+    forget_inode(ino, nlookup);
+    unlock_fs();
+    fuse_reply_none(req);
+}
+
+/**
+ * Forget about multiple inodes
+ *
+ * See description of the forget function for more
+ * information.
+ *
+ * Valid replies:
+ *   fuse_reply_none
+ *
+ * @param req request handle
+ */
+static void nullfs_ll_forget_multi(fuse_req_t req, size_t count,
+struct fuse_forget_data *forgets) {
+    STATS_OP(STATS_FORGET);
+    size_t i;
+
+    lock_fs();
+    begin_update();
+    for (i = 0; i < count; i++)
+        forget_inode(forgets[i].ino, forgets[i].nlookup);
+    unlock_fs();
+    fuse_reply_none(req);
+}
+
+/* open directory handle. readdir continues from cursor, which sits
+   in dirnode's ls_ent list right after the last entry returned, so
+   entries added or removed between calls don't shift the stream.
+   off is the number of entries returned so far */
+struct nulnfs_dirh {
+    struct nulnfs_dirent *cursor;       /* d_ino 0: not an entry */
+    off_t off;
+    char *buf;                          /* reply buffer */
+    size_t bufsize;
+};
+
+/* cursors are taken from the dirent pool, so that the lists they
+   sit in stay within the map, and kept on cursors by h_ent, which
+   they don't use otherwise, until released */
+static struct nulnfs_dirent *alloc_cursor(void) {
+    struct nulnfs_dirent *c;
+
+    if (list_empty(&sb->free_dirents) && ! grow_dirents()
+    && ! reclaim_lru())
+        return NULL;
+    c = list_first_entry(&sb->free_dirents, struct nulnfs_dirent,
+        ls_ent);
+    list_del_init(&c->ls_ent);
+    hlist_add_head(&c->h_ent, &sb->cursors);
+    return c;
+}
+
+static void free_cursor(struct nulnfs_dirent *c) {
+    hlist_del_init(&c->h_ent);
+    list_del_init(&c->ls_ent);
+    list_add_tail(&c->ls_ent, &sb->free_dirents);
+}
+
+/* put cursor after off'th entry of dirnode, for rewinddir/seekdir */
+static void seek_dirh(struct nulnfs_dirh *dh,
+struct nulnfs_inode *dinode, off_t off) {
+    struct list_head *pos = &dinode->ls_ent;
+
+    list_del_init(&dh->cursor->ls_ent);
+    dh->off = 0;
+    while (dh->off < off && list_next(pos) != &dinode->ls_ent) {
+        pos = list_next(pos);
+        if (list_entry(pos, struct nulnfs_dirent, ls_ent)->d_ino != 0)
+            dh->off++;
+    };
+    list_add(&dh->cursor->ls_ent, pos);
+}
+
+static int image_fd = -1;
+
+/* writes the image's dirty pages back to its file. fs_lock isn't
+   taken: the kernel writes pages of the shared mapping back
+   whenever it likes anyway, so holding off updates wouldn't make
+   what's on disk any more consistent, only stall every handler for
+   the length of the flush */
+static void sync_image(void) {
+    if (msync(map_base, sb->map_size, MS_SYNC)) perror(conf.image);
+}
+
+/* -o checkpoint=SEC: flushes the image every SEC seconds, so that
+   after a machine crash no page of it is older than that. pages
+   are written back one by one while updates go on, so such an
+   image may be torn and the tree it holds inconsistent. without
+   the option the kernel writes it back at its own pace, which is
+   all it takes for the daemon to restart */
+static void *checkpoint_thread(void *arg) {
+    (void) arg;
+    for (;;) {
+        sleep(conf.checkpoint);
+        sync_image();
+    };
+    return NULL;
+}
+
+/**
+ * Initialize filesystem
+ *
+ * Called before any other filesystem method
+ *
+ * There's no reply to this function
+ *
+ * @param userdata the user data passed to fuse_lowlevel_new()
+ */
+static void nullfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    (void) userdata;
+    ll_init(conn);
+    nullfs_io_init(conn);
+    nullfs_stats_init();
+    if (image_fd >= 0 && conf.checkpoint > 0) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, checkpoint_thread, NULL) == 0)
+            pthread_detach(t);
+    };
+#ifdef FUSE_CAP_READDIRPLUS
+    /* answer ls -l with one readdirplus instead of a lookup per
+       entry; with _AUTO the kernel picks readdirplus only when
+       entries of the directory are being looked up */
+    if (conn->capable & FUSE_CAP_READDIRPLUS)
+        conn->want |= FUSE_CAP_READDIRPLUS;
+#endif
+#ifdef FUSE_CAP_READDIRPLUS_AUTO
+    if (conn->capable & FUSE_CAP_READDIRPLUS_AUTO)
+        conn->want |= FUSE_CAP_READDIRPLUS_AUTO;
+#endif
+}
+
 /**
  * Open a directory
  *
@@ -213,40 +1017,119 @@ fuse_ino_t par_ino, const char *name) {
  */
 static void nullfs_ll_opendir (fuse_req_t req, fuse_ino_t ino,
 struct fuse_file_info *fi) {
-    const struct nulnfs_inode *dinode;
-
-    if (ino < 1 || ino > n_inodes) fuse_reply_err(req, ENOENT);
-    if (fi == NULL) fuse_reply_err(req, EINVAL);
-    dinode = all_inodes + ino - 1;
-    if (! S_ISDIR(dinode->st.st_mode)) fuse_reply_err(req, ENOTDIR);
-    fi->fh = (int) &dinode->ls_ent;
-    fprintf(stderr, "DEBUG nullfs_ll_opendir ino#%i: ls_ent=%p\n",
-        ino, &dinode->ls_ent);
+    STATS_OP(STATS_OPENDIR);
+    struct nulnfs_dirh *dh;
+    int err = 0;
+
+    if (ino == STATS_DIR_INO) {
+        fi->fh = 0;
+        fuse_reply_open(req, fi);
+        return;
+    };
+    dh = calloc(1, sizeof(*dh));
+    if (dh == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    };
+    lock_fs();
+    if (ino < 1 || ino > sb->n_inodes) err = ENOENT;
+    else if (! S_ISDIR(inode_at(ino)->st.st_mode)) err = ENOTDIR;
+    else {
+        begin_update();
+        if ((dh->cursor = alloc_cursor()) == NULL) err = ENOSPC;
+        else list_add(&dh->cursor->ls_ent, &inode_at(ino)->ls_ent);
+    };
+    unlock_fs();
+
+    if (err) {
+        free(dh);
+        fuse_reply_err(req, err);
+        return;
+    };
+    fi->fh = (uintptr_t) dh;
     fuse_reply_open(req, fi);
 }
 
-struct size_and_pos {
-    size_t size;
-    const struct list_head *pos;
-};
+/* fill dh's buffer with entries following the cursor, with their
+   attributes and lookup references if plus is set, and reply */
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+off_t off, struct fuse_file_info *fi, int plus) {
+    struct nulnfs_dirh *dh = (struct nulnfs_dirh *) (uintptr_t) fi->fh;
+    struct nulnfs_inode *dinode;
+    struct list_head *pos, *last;
+    size_t filled = 0;
+    int err = 0;
+
+    if (ino == STATS_DIR_INO) {
+        stats_readdir(req, size, off, plus);
+        return;
+    };
+    if (dh->bufsize < size) {
+        char *buf = realloc(dh->buf, size);
+        if (buf == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        };
+        dh->buf = buf;
+        dh->bufsize = size;
+    };
+    lock_fs();
+    if (ino < 1 || ino > sb->n_inodes) {
+        err = ENOENT;
+        goto DO_READDIR_OUT;
+    };
+    dinode = inode_at(ino);
+    if (! S_ISDIR(dinode->st.st_mode)) {
+        err = ENOTDIR;
+        goto DO_READDIR_OUT;
+    };
+    /* cursor is detached when directory was removed: end of stream */
+    if (list_empty(&dh->cursor->ls_ent)) goto DO_READDIR_OUT;
+    if (off != dh->off) {
+        begin_update();
+        seek_dirh(dh, dinode, off);
+    };
 
-static struct size_and_pos calculate_ls_buf(
-const struct nulnfs_inode *dinode,
-const struct list_head *pos, size_t max_size) {
-    struct size_and_pos ls = {0, NULL};
-    fprintf(stderr, "DEBUG calculate_ls_buf: dirno#%i, pos=%p, "
-        "pos->next=%p\n", (int)(dinode->st.st_ino), pos, pos->next);
-    for (ls.pos = pos->next; ls.pos != &dinode->ls_ent
-    && ls.pos != pos; ls.pos = ls.pos->next) {
-        fprintf(stderr, "DEBUG calculate_ls_buf: pos=%p, next=%p\n",
-            ls.pos, ls.pos->next);
-        const struct nulnfs_dirent *dirent = list_entry(ls.pos,
+    last = &dh->cursor->ls_ent;
+    for (pos = list_next(last); pos != &dinode->ls_ent;
+    pos = list_next(pos)) {
+        const struct nulnfs_dirent *dirent = list_entry(pos,
             const struct nulnfs_dirent, ls_ent);
-        size_t e_size = fuse_dirent_size(strlen(dirent->de.d_name));
-        if (ls.size + e_size > max_size) break;
-        ls.size += e_size;
+        struct nulnfs_inode *pinode;
+        const char *name;
+        size_t entsize;
+        if (dirent->d_ino == 0) continue;       /* other cursor */
+        pinode = inode_at(dirent->d_ino);
+        name = dirent_name(dirent);
+        if (plus) {
+            struct fuse_entry_param e;
+            fill_entry(&e, pinode);
+            entsize = fuse_add_direntry_plus(req, dh->buf + filled,
+                size - filled, name, &e, dh->off + 1);
+        } else {
+            entsize = fuse_add_direntry(req, dh->buf + filled,
+                size - filled, name, &pinode->st, dh->off + 1);
+        };
+        if (entsize > size - filled) break;
+        /* kernel takes a lookup reference on every entry sent by
+           readdirplus except "." and ".." */
+        if (plus && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+            if (pinode->nlookup++ == 0) begin_update();
+            update_lru(pinode);
+        };
+        filled += entsize;
+        dh->off++;
+        last = pos;
     };
-    return ls;
+    if (last != &dh->cursor->ls_ent) {
+        begin_update();
+        list_move(&dh->cursor->ls_ent, last);
+    };
+DO_READDIR_OUT:
+    unlock_fs();
+
+    if (err) fuse_reply_err(req, err);
+    else fuse_reply_buf(req, dh->buf, filled);
 }
 
 /**
@@ -271,48 +1154,72 @@ const struct list_head *pos, size_t max_size) {
  */
 static void nullfs_ll_readdir(fuse_req_t req, fuse_ino_t ino,
 size_t size, off_t off, struct fuse_file_info *fi) {
-    const struct nulnfs_inode *dinode;
-    const struct list_head *ls_pos;
-    struct size_and_pos ls_buf_end;
-    char *ls_buf;
-
-    if (ino < 1 || ino > n_inodes) fuse_reply_err(req, ENOENT);
-    if (fi == NULL) fuse_reply_err(req, EINVAL);
-    dinode = all_inodes + ino - 1;
-    if (! S_ISDIR(dinode->st.st_mode)) fuse_reply_err(req, ENOTDIR);
-    fprintf(stderr, "DEBUG readdir: ino#%i, offs %i, fh 0x%x, sz %u\n",
-        (int) ino, (int) off, fi->fh, (unsigned) size);
-    if (off) {
-        size_t filled_size = 0;
-        if (off < 1 || off > n_dirents) fuse_reply_err(req, ENOENT);
-        ls_pos = &all_dirents[off - 1].ls_ent;
-    } else {
-        ls_pos = &dinode->ls_ent;
-    };
-    fprintf(stderr, "DEBUG readdir: ls_pos=%p\n", ls_pos);
-    ls_buf_end = calculate_ls_buf(dinode, ls_pos, size);
-    if (ls_buf_end.size == 0) {
-        fuse_reply_buf(req, NULL, 0);
-    };
-    ls_buf = malloc(ls_buf_end.size);
-    if (ls_buf == NULL) {
-        fuse_reply_err(req, ENOMEM);
-    } else {
-        char *buf_pos = ls_buf;
-	for (ls_pos = (ls_pos)->next; ls_pos != ls_buf_end.pos;
-        ls_pos = ls_pos->next) {
-            const struct nulnfs_dirent *dirent = list_entry(ls_pos,
-                const struct nulnfs_dirent, ls_ent);
-            size_t entsize = fuse_add_direntry(req, buf_pos,
-                ls_buf_end.size, dirent->de.d_name,
-                &all_inodes[dirent->de.d_ino - 1].st,
-                dirent->de.d_off);
-            if (buf_pos - ls_buf + entsize > ls_buf_end.size) break;
-            buf_pos += entsize;
-        };
-        fuse_reply_buf(req, ls_buf, buf_pos - ls_buf);
-        free(ls_buf);
+    STATS_OP(STATS_READDIR);
+    do_readdir(req, ino, size, off, fi, 0);
+}
+
+/**
+ * Read directory with attributes
+ *
+ * Send a buffer filled using fuse_add_direntry_plus(), with size not
+ * exceeding the requested size.  Send an empty buffer on end of
+ * stream.
+ *
+ * fi->fh will contain the value set by the opendir method, or
+ * will be undefined if the opendir method didn't set any value.
+ *
+ * In contrast to readdir() (which does not affect the lookup counts),
+ * the lookup count of every entry returned by readdirplus(), except "."
+ * and "..", is incremented by one.
+ *
+ * Valid replies:
+ *   fuse_reply_buf
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param ino the inode number
+ * @param size maximum number of bytes to send
+ * @param off offset to continue reading the directory stream
+ * @param fi file information
+ */
+static void nullfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino,
+size_t size, off_t off, struct fuse_file_info *fi) {
+    STATS_OP(STATS_READDIRPLUS);
+    do_readdir(req, ino, size, off, fi, 1);
+}
+
+/**
+ * Release an open directory
+ *
+ * For every opendir call there will be exactly one releasedir
+ * call.
+ *
+ * fi->fh will contain the value set by the opendir method, or
+ * will be undefined if the opendir method didn't set any value.
+ *
+ * Valid replies:
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param ino the inode number
+ * @param fi file information
+ */
+static void nullfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+struct fuse_file_info *fi) {
+    STATS_OP(STATS_RELEASEDIR);
+    struct nulnfs_dirh *dh = (struct nulnfs_dirh *) (uintptr_t) fi->fh;
+
+    if (ino == STATS_DIR_INO) {
+        fuse_reply_err(req, 0);
+        return;
     };
+    lock_fs();
+    begin_update();
+    free_cursor(dh->cursor);
+    unlock_fs();
+    free(dh->buf);
+    free(dh);
+    fuse_reply_err(req, 0);
 }
 
 /**
@@ -328,106 +1235,346 @@ size_t size, off_t off, struct fuse_file_info *fi) {
  */
 static void nullfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
 struct fuse_file_info *fi) {
-    if (ino < 1 || ino > n_inodes) fuse_reply_err(req, ENOENT);
+    STATS_OP(STATS_GETATTR);
+    struct stat st;
+    int err = 0;
+    (void) fi;
+
+    if (stats_stat(ino, &st)) {
+        fuse_reply_attr(req, &st, 1.0);
+        return;
+    };
+    lock_fs();
+    if (ino < 1 || ino > sb->n_inodes || inode_at(ino)->st.st_mode == 0)
+        err = ENOENT;
+    else
+        st = inode_at(ino)->st;
+    unlock_fs();
 
-    fuse_reply_attr(req, &all_inodes[ino - 1].st, 1.0);
+    if (err) fuse_reply_err(req, err);
+    else fuse_reply_attr(req, &st, 1.0);
 }
 
-int init_fs(int n_inodes, int n_dirents) {
-    int i;
-    int e;
+/**
+ * Open a file
+ *
+ * Files hold no data; only the stats file has something to read.
+ *
+ * Valid replies:
+ *   fuse_reply_open
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param ino the inode number
+ * @param fi file information
+ */
+static void nullfs_ll_open(fuse_req_t req, fuse_ino_t ino,
+struct fuse_file_info *fi) {
+    STATS_OP(STATS_OPEN);
+
+    if (ino == STATS_FILE_INO) stats_open(req, fi);
+    else fuse_reply_open(req, fi);
+}
+
+/**
+ * Read data
+ *
+ * Valid replies:
+ *   fuse_reply_buf
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param ino the inode number
+ * @param size number of bytes to read
+ * @param off offset to read from
+ * @param fi file information
+ */
+static void nullfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+off_t off, struct fuse_file_info *fi) {
+    STATS_OP(STATS_READ);
+
+    if (ino == STATS_FILE_INO) stats_read(req, size, off, fi);
+    else fuse_reply_buf(req, NULL, 0);
+}
+
+/**
+ * Write data made available in a buffer
+ *
+ * Data is discarded, spliced to /dev/null when it comes in a pipe;
+ * files stay empty.
+ *
+ * Valid replies:
+ *   fuse_reply_write
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param ino the inode number
+ * @param bufv buffer containing the data
+ * @param off offset to write to
+ * @param fi file information
+ */
+static void nullfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+    STATS_OP(STATS_WRITE);
+    ssize_t res = nullfs_discard(bufv);
+    (void) ino;
+    (void) off;
+    (void) fi;
+
+    if (res < 0) {
+        fuse_reply_err(req, (int) -res);
+        return;
+    };
+    stats_bytes(STATS_WRITE, res);
+    fuse_reply_write(req, res);
+}
+
+/**
+ * Set file attributes
+ *
+ * chmod, chown and utimens are no-ops, and so is truncate (files
+ * hold no data), which lets O_TRUNC opens through. Replies with
+ * the attributes as they are.
+ *
+ * Valid replies:
+ *   fuse_reply_attr
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param ino the inode number
+ * @param attr the attributes
+ * @param to_set bit mask of attributes which should be set
+ * @param fi file information, or NULL
+ */
+static void nullfs_ll_setattr(fuse_req_t req, fuse_ino_t ino,
+struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    STATS_OP(STATS_SETATTR);
+    (void) attr;
+    (void) to_set;
+
+    nullfs_ll_getattr(req, ino, fi);
+}
+
+/**
+ * Release an open file
+ *
+ * Valid replies:
+ *   fuse_reply_err
+ *
+ * @param req request handle
+ * @param ino the inode number
+ * @param fi file information
+ */
+static void nullfs_ll_release(fuse_req_t req, fuse_ino_t ino,
+struct fuse_file_info *fi) {
+    STATS_OP(STATS_RELEASE);
+
+    if (ino == STATS_FILE_INO) stats_release(req, fi);
+    else fuse_reply_err(req, 0);
+}
+
+/* fills in where things go in a map for given pool limits */
+static void image_layout(struct nulnfs_super *s, unsigned max_inodes,
+unsigned max_dirents) {
+    uint64_t pg = sysconf(_SC_PAGESIZE);
+#define PAGE_UP(n) (((uint64_t) (n) + pg - 1) & ~(pg - 1))
+
+    memset(s, 0, sizeof(*s));
+    memcpy(s->magic, IMAGE_MAGIC, sizeof(s->magic));
+    s->super_size = sizeof(*s);
+    s->inode_size = sizeof(struct nulnfs_inode);
+    s->dirent_size = sizeof(struct nulnfs_dirent);
+    s->max_inodes = max_inodes;
+    s->max_dirents = max_dirents;
+    s->inodes = PAGE_UP(sizeof(*s));
+    s->dirents = s->inodes + PAGE_UP((uint64_t) max_inodes
+        * sizeof(struct nulnfs_inode));
+    s->heap = s->dirents + PAGE_UP((uint64_t) max_dirents
+        * sizeof(struct nulnfs_dirent));
+    /* every dirent may have a 255 byte name and a share of twice
+       its directory's ls_hash (freed smaller tables included),
+       every directory a smallest table */
+    s->heap_size = PAGE_UP((uint64_t) max_dirents
+        * (256 + 4 * sizeof(struct hlist_head))
+        + (uint64_t) max_inodes * 8 * sizeof(struct hlist_head)
+        + NAME_BLOCK);
+    s->map_size = s->heap + s->heap_size;
+    s->name_block_used = NAME_BLOCK;    /* no arena block yet */
+#undef PAGE_UP
+}
+
+/* opens and locks conf.image, sized for a map laid out as *s.
+   an image that can be carried on with is left as it is and its
+   layout replaces *s; one left halfway through an update is
+   started over, one whose size isn't what it says is refused.
+   returns fd or -1 */
+static int open_image(struct nulnfs_super *s) {
+    struct nulnfs_super old;
+    struct stat st;
+    int fd = open(conf.image, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (fd < 0 || flock(fd, LOCK_EX | LOCK_NB) || fstat(fd, &st))
+        goto OPEN_IMAGE_ERR;
+    if (st.st_size != 0) {
+        if (pread(fd, &old, sizeof(old), 0) != sizeof(old)
+        || memcmp(old.magic, IMAGE_MAGIC, sizeof(old.magic)) != 0
+        || old.super_size != s->super_size
+        || old.inode_size != s->inode_size
+        || old.dirent_size != s->dirent_size) {
+            fprintf(stderr, "ERROR: %s is not a nulnfs image\n",
+                conf.image);
+            close(fd);
+            return -1;
+        };
+        if ((uint64_t) st.st_size != old.map_size) {
+            /* cut short or grown by something else: not ours to
+               wipe */
+            fprintf(stderr, "ERROR: %s: image size %lld != %llu,"
+                " refusing\n", conf.image, (long long) st.st_size,
+                (unsigned long long) old.map_size);
+            close(fd);
+            return -1;
+        };
+        if (! old.busy) {
+            *s = old;
+            return fd;
+        };
+        fprintf(stderr, "WARNING: %s was left in the middle of an"
+            " update, starting empty\n", conf.image);
+        if (ftruncate(fd, 0)) goto OPEN_IMAGE_ERR;
+    };
+    if (ftruncate(fd, s->map_size)) goto OPEN_IMAGE_ERR;
+    return fd;
+OPEN_IMAGE_ERR:
+    perror(conf.image);
+    if (fd >= 0) close(fd);
+    return -1;
+}
+
+/* maps metadata, from conf.image if set; returns 0 or -1 */
+static int map_fs(void) {
+    struct nulnfs_super s;
+
+    image_layout(&s, conf.max_inodes, conf.max_dirents);
+    if (conf.image != NULL && (image_fd = open_image(&s)) < 0)
+        return -1;
+    map_base = mmap(NULL, s.map_size, PROT_READ | PROT_WRITE,
+        image_fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+        : MAP_SHARED, image_fd, 0);
+    if (map_base == MAP_FAILED) {
+        perror("nulnfs: mmap");
+        return -1;
+    };
+    sb = (struct nulnfs_super *) map_base;
+    if (memcmp(sb->magic, IMAGE_MAGIC, sizeof(sb->magic)) != 0)
+        *sb = s;
+    inodes = map_ptr(sb->inodes);
+    dirents = map_ptr(sb->dirents);
+    conf.max_inodes = sb->max_inodes;
+    conf.max_dirents = sb->max_dirents;
+    return 0;
+}
+
+/* carry on with the tree of a mapped image: lookups the previous
+   kernel session held are forgotten, and readdir cursors of
+   directories it had open are freed */
+static void resume_fs(void) {
+    struct nulnfs_dirent *c;
+    struct hlist_node *pos, *n;
+
+    hlist_for_each_entry_safe(c, pos, n, &sb->cursors, h_ent)
+        free_cursor(c);
+    while (! list_empty(&sb->held_inodes)) {
+        struct nulnfs_inode *pinode = list_first_entry(
+            &sb->held_inodes, struct nulnfs_inode, held);
+        forget_inode(pinode->st.st_ino, pinode->nlookup);
+    };
+}
+
+int init_fs(unsigned init_inodes, unsigned init_dirents) {
+    int res = 0;
 
     start_t = time(NULL);
 
     memset(&nullfs_ll_ops, 0, sizeof(nullfs_ll_ops));
+    nullfs_ll_ops.init = nullfs_ll_init;
     nullfs_ll_ops.lookup = nullfs_ll_lookup;
     nullfs_ll_ops.getattr = nullfs_ll_getattr;
+    nullfs_ll_ops.setattr = nullfs_ll_setattr;
     nullfs_ll_ops.opendir = nullfs_ll_opendir;
     nullfs_ll_ops.readdir = nullfs_ll_readdir;
+    nullfs_ll_ops.readdirplus = nullfs_ll_readdirplus;
+    nullfs_ll_ops.releasedir = nullfs_ll_releasedir;
+    nullfs_ll_ops.open = nullfs_ll_open;
+    nullfs_ll_ops.read = nullfs_ll_read;
+    nullfs_ll_ops.write_buf = nullfs_ll_write_buf;
+    nullfs_ll_ops.release = nullfs_ll_release;
+    nullfs_ll_ops.mknod = nullfs_ll_mknod;
+    nullfs_ll_ops.mkdir = nullfs_ll_mkdir;
+    nullfs_ll_ops.create = nullfs_ll_create;
+    nullfs_ll_ops.unlink = nullfs_ll_unlink;
+    nullfs_ll_ops.rmdir = nullfs_ll_rmdir;
+    nullfs_ll_ops.forget = nullfs_ll_forget;
+    nullfs_ll_ops.forget_multi = nullfs_ll_forget_multi;
 
-    all_inodes = (struct nulnfs_inode *)
-        malloc(sizeof(struct nulnfs_inode) * n_inodes);
-    if (all_inodes == NULL) {
-        fprintf(stderr, "ERROR: cannot allocate %i inodes\n", n_inodes);
-        return 1;
-    };
-    memset(all_inodes, 0, sizeof(struct nulnfs_inode) * n_inodes);
+    /* pools never shrink below initial size; round limits up
+       to whole chunks */
+    if (conf.max_inodes < init_inodes) conf.max_inodes = init_inodes;
+    if (conf.max_dirents < init_dirents) conf.max_dirents = init_dirents;
+    conf.max_inodes = (conf.max_inodes + POOL_CHUNK - 1)
+        & ~(POOL_CHUNK - 1);
+    conf.max_dirents = (conf.max_dirents + POOL_CHUNK - 1)
+        & ~(POOL_CHUNK - 1);
+    if (map_fs()) return 1;
 
-    all_dirents = (struct nulnfs_dirent *)
-        malloc(sizeof(struct nulnfs_dirent) * n_dirents);
-    if (all_dirents == NULL) {
-        fprintf(stderr, "ERROR: cannot allocate %i dirents\n", n_dirents);
-        free(all_inodes);
-        return 2;
+    lock_fs();
+    begin_update();
+    if (sb->n_inodes != 0) {
+        resume_fs();
+        goto INIT_FS_OUT;
     };
-
-    /* initialize all inodes anf list them as free: */
-    for (i = 0; i < n_inodes; i++) {
-        all_inodes[i].st.st_ino = i + 1;
-        INIT_LIST_HEAD(&(all_inodes[i].r_ent));
-        INIT_LIST_HEAD(&(all_inodes[i].ls_ent));
-        INIT_LIST_HEAD(&(all_inodes[i].free_ino));
-        list_add_tail(&(all_inodes[i].free_ino), &free_inodes);
+    /* allocate initial inodes and dirents and list them as free: */
+    while (sb->n_inodes < init_inodes || sb->n_inodes == 0) {
+        if (! grow_inodes()) {
+            fprintf(stderr, "ERROR: cannot allocate %u inodes\n",
+                init_inodes);
+            res = 1;
+            goto INIT_FS_OUT;
+        };
     };
-    /* initialize all dirents and list them as free: */
-    for (e = 0; e < n_dirents; e++) {
-        all_dirents[e].de.d_off = e + 1;
-        all_dirents[e].p_ino = 0;       /* no parent yet */
-        INIT_LIST_HEAD(&(all_dirents[e].ls_ent));
-        INIT_LIST_HEAD(&(all_dirents[e].free_ent));
-        list_add_tail(&(all_dirents[e].free_ent), &free_dirents);
+    while (sb->n_dirents < init_dirents || sb->n_dirents == 0) {
+        if (! grow_dirents()) {
+            fprintf(stderr, "ERROR: cannot allocate %u dirents\n",
+                init_dirents);
+            res = 2;
+            goto INIT_FS_OUT;
+        };
     };
 
     /* initialize root inode #1: */
-    if (! init_dirnode(all_inodes + 0, 1, 0, 0, 0, 0755)) {
+    if (! init_dirnode(inode_at(1), 1, 0, 0, 0, 0755)) {
         fprintf(stderr, "ERROR: cannot initialize inode #1\n");
-        free(all_inodes);
-        free(all_dirents);
-        return 3;
-    };
-    /* initialize root dirent */
-    /*
-    all_dirents[0].de.d_ino = 1;
-    all_dirents[0].de.d_reclen = 1;
-    all_dirents[0].de.d_type = DT_DIR;
-    strcpy(all_dirents[0].de.d_name, "/");
-    */
-
-    return 0;
+        res = 3;
+    };
+INIT_FS_OUT:
+    unlock_fs();
+    return res;
 }
 
+#ifndef NULLFS_NO_MAIN
 int main(int argc, char *argv[]) {
     int res;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    struct fuse_chan *ch;
 
-    res = init_fs(n_inodes, n_dirents);
+    if (fuse_opt_parse(&args, &conf, nulnfs_opts, NULL) == -1)
+        return 1;
+    res = init_fs(conf.inodes, conf.dirents);
     if (res) return res;
 
-    /* TODO: implement cmdline options for setting custom
-       n_inodes and n_dirents values */
-    if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1
-    && (ch = fuse_mount(mountpoint, &args)) != NULL) {
-        struct fuse_session *se;
-
-        se = fuse_lowlevel_new(&args, &nullfs_ll_ops,
-            sizeof(nullfs_ll_ops), NULL);
-
-        if (se != NULL) {
-            if (fuse_set_signal_handlers(se) != -1) {
-                fuse_session_add_chan(se, ch);
-                res = fuse_session_loop(se);
-                fuse_remove_signal_handlers(se);
-                fuse_session_remove_chan(ch);
-            }
-            fuse_session_destroy(se);
-        } else res = 3;
-
-        fuse_unmount(mountpoint, ch);
-    }
-    fuse_opt_free_args(&args);
-
+    res = ll_main(&args, &nullfs_ll_ops, sizeof(nullfs_ll_ops));
+    if (image_fd >= 0) sync_image();
     return res;
 }
+#endif /* NULLFS_NO_MAIN */
 
 /* vi:set sw=4 et tw=72: */